@@ -10,7 +10,7 @@
 
 
 #define UPD_VER_MAJOR UINT16_C(0)
-#define UPD_VER_MINOR UINT16_C(10)
+#define UPD_VER_MINOR UINT16_C(11)
 
 #define UPD_VER  \
   ((UPD_VER_MAJOR) << 16 | UPD_VER_MINOR)
@@ -357,12 +357,21 @@ static inline upd_file_lock_t* upd_file_lock_with_dup(
   f(0x0004, DSTREAM)  \
   f(0x0005, TENSOR)
 
+/* DIR_NEWPATH creates all dirs of a relative path ("a/b/c", without empty
+ * components) under req->file, and sets the deepest one to dir.entry.file.
+ * The path buffer is owned by the requester and valid only until the
+ * callback, so the driver must copy it if it needs the name later.
+ * upd_req() returning false means the driver doesn't support it and the
+ * requester may fall back to DIR_NEWDIR for each dir, while a result other
+ * than UPD_REQ_OK in the callback means the driver tried and failed,
+ * possibly leaving some of the dirs made. (since 0.11) */
 #define UPD_REQ_TYPE_EACH(f)  \
   f(DIR, 0x0010, LIST)  \
   f(DIR, 0x0020, FIND)  \
   f(DIR, 0x0030, ADD)  \
   f(DIR, 0x0038, NEW)  \
   f(DIR, 0x0039, NEWDIR)  \
+  f(DIR, 0x003A, NEWPATH)  \
   f(DIR, 0x0040, RM)  \
 \
   f(STREAM, 0x0010, READ)  \
@@ -398,6 +407,11 @@ typedef struct upd_req_dir_entry_t {
   uint8_t*    name;
   uint64_t    len;
   upd_file_t* file;
+
+  /* FNV-1a hash of the name (see upd_path_hash() in libupd/path.h),
+   * only valid when the hashed flag is set */
+  uint32_t hash;
+  unsigned hashed : 1;
 } upd_req_dir_entry_t;
 
 typedef struct upd_req_dir_entries_t {
@@ -412,6 +426,12 @@ typedef struct upd_req_stream_io_t {
   uint8_t* buf;
 
   unsigned tail : 1;
+
+  /* DSTREAM_WRITE only: buf is NULL and the handler lends size bytes in buf,
+   * which must be filled in the callback, setting size to the filled length.
+   * The handler reads size after the callback, so req must outlive it.
+   * (only for drivers supporting it) */
+  unsigned reserve : 1;
 } upd_req_stream_io_t;
 
 
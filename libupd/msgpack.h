@@ -1,7 +1,10 @@
 #pragma once
 
+#include <assert.h>
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
+#include <string.h>
 
 #include <hedley.h>
 #include <msgpack.h>
@@ -9,23 +12,102 @@
 
 #include <libupd.h>
 
+#include "array.h"
+#include "memory.h"
+#include "str.h"
 
-typedef struct upd_msgpack_t       upd_msgpack_t;
-typedef struct upd_msgpack_recv_t  upd_msgpack_recv_t;
 
-typedef struct upd_msgpack_field_t upd_msgpack_field_t;
+typedef struct upd_msgpack_t          upd_msgpack_t;
+typedef struct upd_msgpack_inflight_t upd_msgpack_inflight_t;
+typedef struct upd_msgpack_recv_t    upd_msgpack_recv_t;
+typedef struct upd_msgpack_visitor_t upd_msgpack_visitor_t;
+typedef struct upd_msgpack_event_t   upd_msgpack_event_t;
+
+typedef struct upd_msgpack_zone_pool_t upd_msgpack_zone_pool_t;
+
+typedef struct upd_msgpack_field_t    upd_msgpack_field_t;
+typedef struct upd_msgpack_fieldset_t upd_msgpack_fieldset_t;
+
+typedef struct upd_msgpack_template_t upd_msgpack_template_t;
+
+
+/* values of more fields are collected in heap */
+#define UPD_MSGPACK_FIELDSET_MAX 32
+
+#define UPD_MSGPACK_VISITOR_DEPTH_MAX 32
+
+#define UPD_MSGPACK_ZONE_POOL_MAX     8
+#define UPD_MSGPACK_ZONE_POOL_DEFAULT 2
+
+#define UPD_MSGPACK_PACK_BUF 512
+
+#define UPD_MSGPACK_TEMPLATE_MAX   16
+#define UPD_MSGPACK_TEMPLATE_BYTES 256
+
+
+/* Element types of bulk numeric arrays. The values are also used as ext types
+ * of blobs made by upd_msgpack_pack_blob(), whose body is the raw elements in
+ * little endian. */
+typedef enum upd_msgpack_numeric_t {
+  UPD_MSGPACK_U8  = 0x40,
+  UPD_MSGPACK_U16 = 0x41,
+  UPD_MSGPACK_I32 = 0x42,
+  UPD_MSGPACK_F32 = 0x43,
+  UPD_MSGPACK_F64 = 0x44,
+} upd_msgpack_numeric_t;
+
+
+/* Zones released by unpacked objects are cleared and kept here to be reused
+ * by the next object. msgpack_zone_clear() shrinks a zone to its first
+ * chunk, so retained memory is about max * MSGPACK_ZONE_CHUNK_SIZE. */
+struct upd_msgpack_zone_pool_t {
+  size_t max;  /* zero means UPD_MSGPACK_ZONE_POOL_DEFAULT */
+
+  size_t        n;
+  msgpack_zone* zones[UPD_MSGPACK_ZONE_POOL_MAX];
+};
+
+/* returned by upd_msgpack_find_fields_compiled() for a rejected unknown key */
+#define UPD_MSGPACK_FIELD_UNKNOWN "(unknown)"
 
 struct upd_msgpack_t {
   size_t maxmem;
   size_t mem;
 
+  /* Writes are held without completion while mem is above highmem, until
+   * it goes down to lowmem by popping. Zero highmem disables this.
+   * Popping completes them, which may call the callback inside. */
+  size_t highmem;
+  size_t lowmem;
+  upd_array_of(upd_req_t*) held;
+
   msgpack_packer   pk;
   msgpack_unpacker upk;
 
+  /* packer writes to out while a reader holds reading, and they are swapped
+   * when reading is drained (both keep their capacity) */
   msgpack_sbuffer out;
-
-  unsigned busy   : 1;
-  unsigned broken : 1;
+  msgpack_sbuffer reading;
+  size_t          readoff;
+
+  upd_msgpack_zone_pool_t zones;
+
+  /* Up to maxinflight objects (zero means 1) can be processed at once by
+   * upd_msgpack_begin(). Responses are written as soon as they end, or in
+   * order of the requests if ordered is true. Fill them after init.
+   * Ending an object in the callback calls it again after it returns,
+   * never recursively. */
+  size_t maxinflight;
+  bool   ordered;
+  upd_array_of(upd_msgpack_inflight_t*) inflight;
+
+  unsigned busy      : 1;
+  unsigned broken    : 1;
+  unsigned paused    : 1;
+  unsigned reserving : 1;
+  unsigned accepting : 1;
+  unsigned calling   : 1;
+  unsigned pending   : 1;  /* the callback is wanted again after it returns */
 
   void* udata;
   void
@@ -33,6 +115,91 @@ struct upd_msgpack_t {
     upd_msgpack_t* mpk);
 };
 
+/* An object being processed concurrently with others on the same stream.
+ * Its zone is alive until upd_msgpack_end(). */
+struct upd_msgpack_inflight_t {
+  /* filled by upd_msgpack_begin() */
+  upd_msgpack_t*        mpk;
+  msgpack_unpacked      upkd;
+  const msgpack_object* id;  /* "id" of the root map echoed back, or NULL */
+
+  /* used internally */
+  msgpack_packer  pk;
+  msgpack_sbuffer out;  /* response waiting for preceding ones */
+  unsigned        done : 1;
+
+  void* udata;
+};
+
+typedef enum upd_msgpack_event_type_t {
+  UPD_MSGPACK_EVENT_NIL,
+  UPD_MSGPACK_EVENT_BOOL,
+  UPD_MSGPACK_EVENT_UINT,
+  UPD_MSGPACK_EVENT_INT,
+  UPD_MSGPACK_EVENT_FLOAT,
+
+  /* chunks of body, emitted as bytes arrive */
+  UPD_MSGPACK_EVENT_STR,
+  UPD_MSGPACK_EVENT_BIN,
+  UPD_MSGPACK_EVENT_EXT,
+
+  /* containers */
+  UPD_MSGPACK_EVENT_MAP,
+  UPD_MSGPACK_EVENT_ARRAY,
+  UPD_MSGPACK_EVENT_MAP_END,
+  UPD_MSGPACK_EVENT_ARRAY_END,
+} upd_msgpack_event_type_t;
+
+struct upd_msgpack_event_t {
+  upd_msgpack_event_type_t type;
+
+  size_t depth;
+  bool   key;  /* the value is a key of map */
+
+  union {
+    bool     b;
+    uint64_t u;
+    int64_t  i;
+    double   f;
+    size_t   n;  /* count of map pairs or array items */
+    struct {
+      const uint8_t* ptr;
+      size_t         size;
+      size_t         offset;
+      size_t         total;
+      int8_t         ext;
+      bool           tail;
+    } chunk;
+  };
+};
+
+/* parses msgpack bytes incrementally without building any objects,
+ * so memory usage is bounded by UPD_MSGPACK_VISITOR_DEPTH_MAX */
+struct upd_msgpack_visitor_t {
+  /* filled by user */
+  void* udata;
+  bool
+  (*cb)(
+    upd_msgpack_visitor_t*     v,
+    const upd_msgpack_event_t* e);  /* returns false to abort */
+
+  /* used internally */
+  bool broken;
+
+  uint8_t head[9];
+  size_t  headlen;
+  size_t  headneed;
+
+  upd_msgpack_event_t body;
+  size_t              rest;
+
+  size_t depth;
+  struct {
+    uint64_t rest;
+    bool     map;
+  } stack[UPD_MSGPACK_VISITOR_DEPTH_MAX];
+};
+
 struct upd_msgpack_recv_t {
   upd_file_t*      file;
   upd_file_watch_t watch;
@@ -41,8 +208,20 @@ struct upd_msgpack_recv_t {
   msgpack_unpacker upk;
   msgpack_unpacked upkd;
 
+  upd_msgpack_zone_pool_t zones;
+
   msgpack_object* obj;
 
+  /* drain mode: all complete objects from the last read */
+  msgpack_object*   objs;
+  size_t            objn;
+  msgpack_unpacked* upkds;
+  size_t            upkdn;
+
+  /* filled by user: events are emitted to visitor instead of building objects */
+  upd_msgpack_visitor_t* visitor;
+
+  unsigned drain   : 1;  /* filled by user */
   unsigned first   : 1;
   unsigned ok      : 1;
   unsigned busy    : 1;
@@ -71,6 +250,33 @@ struct upd_msgpack_field_t {
   const msgpack_object_str**   str;
 };
 
+/* Compiled names of a field list, usually placed in static storage and
+ * compiled at the first use. Fields passed with it must have the same names
+ * in the same order. Outside static storage, names must be freed by
+ * upd_str_set_clear(). */
+struct upd_msgpack_fieldset_t {
+  /* filled by user */
+  bool reject_dup;
+  bool reject_unknown;
+
+  /* filled by upd_msgpack_fieldset_compile() */
+  bool          compiled;
+  upd_str_set_t names;
+};
+
+/* Map skeleton whose header and keys are encoded only once, usually placed
+ * in static storage and compiled at the first use. */
+struct upd_msgpack_template_t {
+  /* filled by user */
+  const char* const* keys;  /* terminated by NULL */
+
+  /* filled by upd_msgpack_template_compile() */
+  bool    compiled;
+  size_t  n;
+  size_t  offs[UPD_MSGPACK_TEMPLATE_MAX+1];  /* key i is bytes[offs[i]..offs[i+1]] */
+  uint8_t bytes[UPD_MSGPACK_TEMPLATE_BYTES];
+};
+
 
 HEDLEY_NON_NULL(1)
 static inline
@@ -93,6 +299,43 @@ upd_msgpack_unpack(
   const uint8_t* buf,
   size_t         len);
 
+HEDLEY_NON_NULL(1)
+HEDLEY_WARN_UNUSED_RESULT
+static inline
+uint8_t*
+upd_msgpack_reserve(
+  upd_msgpack_t* mpk,
+  size_t         len);
+
+HEDLEY_NON_NULL(1)
+static inline
+void
+upd_msgpack_commit(
+  upd_msgpack_t* mpk,
+  size_t         len);
+
+HEDLEY_NON_NULL(1, 2, 3)
+static inline
+int
+upd_msgpack_next(
+  msgpack_unpacker*        upk,
+  msgpack_unpacked*        upkd,
+  upd_msgpack_zone_pool_t* pool,
+  size_t*                  consumed);
+
+HEDLEY_NON_NULL(1, 2)
+static inline
+void
+upd_msgpack_zone_pool_put(
+  upd_msgpack_zone_pool_t* pool,
+  msgpack_zone*            zone);
+
+HEDLEY_NON_NULL(1)
+static inline
+void
+upd_msgpack_zone_pool_clear(
+  upd_msgpack_zone_pool_t* pool);
+
 HEDLEY_NON_NULL(1)
 static inline
 bool
@@ -107,6 +350,44 @@ upd_msgpack_handle(
   upd_msgpack_t* mpk,
   upd_req_t*     req);
 
+/* Completes writes held by flow control, if popping has lowered mem enough.
+ * Popping and upd_msgpack_handle() call this, so users rarely need to.
+ * Calls from callbacks of mpk are ignored and taken over by the outer one. */
+HEDLEY_NON_NULL(1)
+static inline
+void
+upd_msgpack_resume(
+  upd_msgpack_t* mpk);
+
+/* Pops the next object into a new in-flight entry. Returns NULL if no
+ * complete object is available or the table is full. */
+HEDLEY_NON_NULL(1)
+HEDLEY_WARN_UNUSED_RESULT
+static inline
+upd_msgpack_inflight_t*
+upd_msgpack_begin(
+  upd_msgpack_t* mpk);
+
+/* Packs a map header of n pairs (and "id" if the request has it) and
+ * returns a packer for the n pairs. The packer may write directly to the
+ * output shared by all in-flight objects, so call this only when the whole
+ * response is ready: all n pairs must be packed before control returns to
+ * the event loop. upd_msgpack_end() can come later. */
+HEDLEY_NON_NULL(1)
+HEDLEY_WARN_UNUSED_RESULT
+static inline
+msgpack_packer*
+upd_msgpack_respond(
+  upd_msgpack_inflight_t* inf,
+  size_t                  n);
+
+/* Writes responses ready to go out and frees the entry. */
+HEDLEY_NON_NULL(1)
+static inline
+void
+upd_msgpack_end(
+  upd_msgpack_inflight_t* inf);
+
 
 HEDLEY_NON_NULL(1)
 HEDLEY_WARN_UNUSED_RESULT
@@ -128,6 +409,16 @@ upd_msgpack_recv_next(
   upd_msgpack_recv_t* recv);
 
 
+HEDLEY_NON_NULL(1)
+HEDLEY_WARN_UNUSED_RESULT
+static inline
+bool
+upd_msgpack_visitor_feed(
+  upd_msgpack_visitor_t* v,
+  const uint8_t*         buf,
+  size_t                 len);
+
+
 HEDLEY_NON_NULL(1, 2)
 static inline
 const msgpack_object*
@@ -159,6 +450,25 @@ upd_msgpack_find_fields(
   const upd_msgpack_field_t* field);
 
 
+HEDLEY_NON_NULL(1, 2)
+HEDLEY_WARN_UNUSED_RESULT
+static inline
+bool
+upd_msgpack_fieldset_compile(
+  upd_msgpack_fieldset_t*    fs,
+  const upd_msgpack_field_t* field);
+
+/* Falls back to upd_msgpack_find_fields() if fs cannot be compiled. */
+HEDLEY_NON_NULL(1, 2, 3)
+HEDLEY_WARN_UNUSED_RESULT
+static inline
+const char*
+upd_msgpack_find_fields_compiled(
+  const msgpack_object_map*  map,
+  upd_msgpack_fieldset_t*    fs,
+  const upd_msgpack_field_t* field);
+
+
 HEDLEY_NON_NULL(1, 2)
 HEDLEY_WARN_UNUSED_RESULT
 static inline
@@ -175,12 +485,160 @@ upd_msgpack_pack_bool(
   msgpack_packer* pk,
   bool            b);
 
+/* Packs n elements as a msgpack array. Headers and elements are encoded into
+ * a local buffer and passed to the packer callback at once. */
+HEDLEY_NON_NULL(1)
+HEDLEY_WARN_UNUSED_RESULT
+static inline
+int
+upd_msgpack_pack_array(
+  msgpack_packer*       pk,
+  upd_msgpack_numeric_t type,
+  const void*           ptr,
+  size_t                n);
+
+/* Packs n elements as an ext blob whose type is the element type. */
+HEDLEY_NON_NULL(1)
+HEDLEY_WARN_UNUSED_RESULT
+static inline
+int
+upd_msgpack_pack_blob(
+  msgpack_packer*       pk,
+  upd_msgpack_numeric_t type,
+  const void*           ptr,
+  size_t                n);
+
+/* Decodes an array, an ext blob of the same type, or a bin (only for U8) into
+ * dst. n is a capacity of dst in elements, and is replaced with a number of
+ * decoded elements on success. */
+HEDLEY_NON_NULL(1, 4)
+HEDLEY_WARN_UNUSED_RESULT
+static inline
+bool
+upd_msgpack_unpack_array(
+  const msgpack_object* obj,
+  upd_msgpack_numeric_t type,
+  void*                 dst,
+  size_t*               n);
+
+/* Encodes the map header and keys. Calling this is optional as the
+ * functions below compile t at the first use. */
+HEDLEY_NON_NULL(1)
+HEDLEY_WARN_UNUSED_RESULT
+static inline
+bool
+upd_msgpack_template_compile(
+  upd_msgpack_template_t* t);
+
+/* Returns bytes of i-th key (with the map header if i is 0) to be copied
+ * into preallocated output, or NULL if t cannot be compiled. */
+HEDLEY_NON_NULL(1, 3)
+HEDLEY_WARN_UNUSED_RESULT
+static inline
+const uint8_t*
+upd_msgpack_template_key(
+  upd_msgpack_template_t* t,
+  size_t                  i,
+  size_t*                 size);
+
+/* Packs i-th key (with the map header if i is 0), followed by its value
+ * packed by the caller. Returns -1 if t cannot be compiled. */
+HEDLEY_NON_NULL(1, 2)
+HEDLEY_WARN_UNUSED_RESULT
+static inline
+int
+upd_msgpack_template_pack_key(
+  msgpack_packer*         pk,
+  upd_msgpack_template_t* t,
+  size_t                  i);
+
+
+static inline
+bool
+upd_msgpack_field_assign_(
+  const upd_msgpack_field_t* f,
+  const msgpack_object*      v);
+
+static inline
+size_t
+upd_msgpack_numeric_size_(
+  upd_msgpack_numeric_t type);
+
+static inline
+size_t
+upd_msgpack_numeric_pack_(
+  uint8_t*              p,
+  upd_msgpack_numeric_t type,
+  const uint8_t*        src);
+
+static inline
+bool
+upd_msgpack_numeric_unpack_(
+  uint8_t*              dst,
+  upd_msgpack_numeric_t type,
+  const msgpack_object* v);
+
+static inline
+void
+upd_msgpack_put_be_(
+  uint8_t* p,
+  uint64_t v,
+  size_t   n);
+
+static inline
+uint64_t
+upd_msgpack_be_(
+  const uint8_t* p,
+  size_t         n);
+
+static inline
+size_t
+upd_msgpack_visitor_head_size_(
+  uint8_t c);
+
+static inline
+bool
+upd_msgpack_visitor_head_(
+  upd_msgpack_visitor_t* v);
+
+static inline
+bool
+upd_msgpack_visitor_emit_(
+  upd_msgpack_visitor_t* v,
+  upd_msgpack_event_t*   e);
+
+static inline
+bool
+upd_msgpack_visitor_done_(
+  upd_msgpack_visitor_t* v);
+
+static inline
+void
+upd_msgpack_inflight_free_(
+  upd_msgpack_inflight_t* inf);
+
+static inline
+bool
+upd_msgpack_accept_(
+  upd_msgpack_t* mpk,
+  upd_req_t*     req);
+
+static inline
+void
+upd_msgpack_call_(
+  upd_msgpack_t* mpk);
+
 
 static inline
 void
 upd_msgpack_recv_watch_cb_(
   upd_file_watch_t* w);
 
+static inline
+void
+upd_msgpack_recv_drain_(
+  upd_msgpack_recv_t* recv);
+
 static inline
 void
 upd_msgpack_recv_read_cb_(
@@ -198,35 +656,131 @@ static inline bool upd_msgpack_init(upd_msgpack_t* mpk) {
   }
   msgpack_packer_init(&mpk->pk, &mpk->out, msgpack_sbuffer_write);
   msgpack_sbuffer_init(&mpk->out);
+  msgpack_sbuffer_init(&mpk->reading);
   return true;
 }
 
 static inline void upd_msgpack_deinit(upd_msgpack_t* mpk) {
+  while (mpk->held.n) {
+    upd_req_t* req = upd_array_remove(&mpk->held, 0);
+    req->result = UPD_REQ_ABORTED;
+    req->cb(req);
+  }
+  while (mpk->inflight.n) {
+    upd_msgpack_inflight_free_(upd_array_remove(&mpk->inflight, 0));
+  }
+  msgpack_sbuffer_destroy(&mpk->reading);
   msgpack_sbuffer_destroy(&mpk->out);
+  upd_msgpack_zone_pool_clear(&mpk->zones);
   msgpack_unpacker_destroy(&mpk->upk);
 }
 
 static inline bool upd_msgpack_unpack(
     upd_msgpack_t* mpk, const uint8_t* buf, size_t len) {
-  if (HEDLEY_UNLIKELY(mpk->mem+len > mpk->maxmem)) {
+  uint8_t* ptr = upd_msgpack_reserve(mpk, len);
+  if (HEDLEY_UNLIKELY(ptr == NULL)) {
     return false;
   }
+  memcpy(ptr, buf, len);
+  upd_msgpack_commit(mpk, len);
+  return true;
+}
 
+/* returns a writable region of len bytes inside the unpacker buffer,
+ * which is valid until the next reserve or commit */
+static inline uint8_t* upd_msgpack_reserve(upd_msgpack_t* mpk, size_t len) {
+  if (HEDLEY_UNLIKELY(mpk->mem+len > mpk->maxmem)) {
+    return NULL;
+  }
   if (HEDLEY_UNLIKELY(!msgpack_unpacker_reserve_buffer(&mpk->upk, len))) {
-    return false;
+    return NULL;
   }
-  mpk->mem += len;
+  return (uint8_t*) msgpack_unpacker_buffer(&mpk->upk);
+}
+
+static inline void upd_msgpack_commit(upd_msgpack_t* mpk, size_t len) {
+  assert(len <= msgpack_unpacker_buffer_capacity(&mpk->upk));
 
-  memcpy(msgpack_unpacker_buffer(&mpk->upk), buf, len);
+  mpk->mem += len;
   msgpack_unpacker_buffer_consumed(&mpk->upk, len);
-  return true;
+}
+
+/* Works like msgpack_unpacker_next_with_size() but recycles zones,
+ * consumed is set only when an object is returned.
+ * This does what msgpack_unpacker_release_zone() does with a pooled zone,
+ * so it relies on the C unpacker of msgpack-c 3.x (the msgpackc target),
+ * where upk->z is the zone of the object being unpacked. */
+static inline int upd_msgpack_next(
+    msgpack_unpacker*        upk,
+    msgpack_unpacked*        upkd,
+    upd_msgpack_zone_pool_t* pool,
+    size_t*                  consumed) {
+  if (upkd->zone) {
+    upd_msgpack_zone_pool_put(pool, upkd->zone);
+    upkd->zone = NULL;
+  }
+  memset(&upkd->data, 0, sizeof(upkd->data));
+
+  const int ret = msgpack_unpacker_execute(upk);
+  if (HEDLEY_UNLIKELY(ret < 0)) {
+    return MSGPACK_UNPACK_PARSE_ERROR;
+  }
+  if (ret == 0) {
+    return MSGPACK_UNPACK_CONTINUE;
+  }
+
+  msgpack_zone* z = pool->n?
+    pool->zones[--pool->n]: msgpack_zone_new(MSGPACK_ZONE_CHUNK_SIZE);
+  if (HEDLEY_UNLIKELY(z == NULL)) {
+    return MSGPACK_UNPACK_NOMEM_ERROR;
+  }
+  if (HEDLEY_UNLIKELY(!msgpack_unpacker_flush_zone(upk))) {
+    upd_msgpack_zone_pool_put(pool, z);
+    return MSGPACK_UNPACK_NOMEM_ERROR;
+  }
+  upkd->zone = upk->z;
+  upkd->data = msgpack_unpacker_data(upk);
+  upk->z     = z;
+
+  *consumed = msgpack_unpacker_parsed_size(upk);
+  msgpack_unpacker_reset(upk);
+  return MSGPACK_UNPACK_SUCCESS;
+}
+
+static inline void upd_msgpack_zone_pool_put(
+    upd_msgpack_zone_pool_t* pool, msgpack_zone* zone) {
+  size_t max = pool->max? pool->max: UPD_MSGPACK_ZONE_POOL_DEFAULT;
+  if (max > UPD_MSGPACK_ZONE_POOL_MAX) {
+    max = UPD_MSGPACK_ZONE_POOL_MAX;
+  }
+  if (HEDLEY_UNLIKELY(pool->n >= max)) {
+    msgpack_zone_free(zone);
+    return;
+  }
+  msgpack_zone_clear(zone);
+  pool->zones[pool->n++] = zone;
+}
+
+static inline void upd_msgpack_zone_pool_clear(upd_msgpack_zone_pool_t* pool) {
+  while (pool->n) {
+    msgpack_zone_free(pool->zones[--pool->n]);
+  }
 }
 
 static inline bool upd_msgpack_pop(upd_msgpack_t* mpk, msgpack_unpacked* upkd) {
   size_t consumed = 0;
-  const int ret = msgpack_unpacker_next_with_size(&mpk->upk, upkd, &consumed);
+  const int ret = upd_msgpack_next(&mpk->upk, upkd, &mpk->zones, &consumed);
   mpk->mem -= consumed;
 
+  /* a partial object cannot be popped until more bytes come,
+   * so holding writes then would never end */
+  if (HEDLEY_UNLIKELY(mpk->paused)) {
+    if (mpk->mem <= mpk->lowmem || ret == MSGPACK_UNPACK_CONTINUE) {
+      mpk->paused = false;
+      upd_msgpack_resume(mpk);
+    }
+  }
+
   switch (ret) {
   case MSGPACK_UNPACK_SUCCESS:
     return true;
@@ -234,7 +788,7 @@ static inline bool upd_msgpack_pop(upd_msgpack_t* mpk, msgpack_unpacked* upkd) {
   case MSGPACK_UNPACK_CONTINUE:
     return false;
 
-  case MSGPACK_UNPACK_PARSE_ERROR:
+  default:
     mpk->broken = true;
     return false;
   }
@@ -244,27 +798,53 @@ static inline bool upd_msgpack_handle(upd_msgpack_t* mpk, upd_req_t* req) {
   upd_req_stream_io_t* io = &req->stream.io;
 
   switch (req->type) {
-  case UPD_REQ_DSTREAM_WRITE: {
-    if (HEDLEY_UNLIKELY(!upd_msgpack_unpack(mpk, io->buf, io->size))) {
-      req->result = UPD_REQ_NOMEM;
+  case UPD_REQ_DSTREAM_WRITE:
+    /* a write from the reserve callback would move the lent region */
+    if (HEDLEY_UNLIKELY(mpk->reserving)) {
+      req->result = UPD_REQ_INVALID;
       return false;
     }
-    if (HEDLEY_UNLIKELY(!mpk->busy)) {
-      mpk->cb(mpk);
+    /* writes held before must go first, and ones from callbacks wait */
+    if (HEDLEY_UNLIKELY(mpk->paused || mpk->held.n || mpk->accepting)) {
+      if (HEDLEY_UNLIKELY(!upd_array_insert(&mpk->held, req, SIZE_MAX))) {
+        req->result = UPD_REQ_NOMEM;
+        return false;
+      }
+      upd_msgpack_resume(mpk);
+      return true;
+    }
+    if (HEDLEY_UNLIKELY(!upd_msgpack_accept_(mpk, req))) {
+      req->result = UPD_REQ_NOMEM;
+      return false;
     }
-    req->result = UPD_REQ_OK;
-    req->cb(req);
-  } return true;
+    upd_msgpack_resume(mpk);
+    return true;
 
   case UPD_REQ_DSTREAM_READ: {
+    msgpack_sbuffer* rd = &mpk->reading;
+    if (mpk->readoff >= rd->size) {
+      const msgpack_sbuffer temp = *rd;
+      *rd = mpk->out;
+      mpk->out = temp;
+      mpk->out.size = 0;
+      mpk->readoff  = 0;
+    }
+
+    /* zero size takes everything available */
+    size_t n = rd->size - mpk->readoff;
+    if (io->size && n > io->size) {
+      n = io->size;
+    }
     *io = (upd_req_stream_io_t) {
-      .buf  = (uint8_t*) mpk->out.data,
-      .size = mpk->out.size,
+      .buf  = (uint8_t*) rd->data + mpk->readoff,
+      .size = n,
+      .tail = mpk->readoff+n == rd->size && mpk->out.size == 0,
     };
-    uint8_t* ptr = (void*) msgpack_sbuffer_release(&mpk->out);
+    mpk->readoff += n;
+
+    /* reading is never touched by the packer while the reader holds it */
     req->result = UPD_REQ_OK;
     req->cb(req);
-    free(ptr);
   } return true;
 
   default:
@@ -272,6 +852,111 @@ static inline bool upd_msgpack_handle(upd_msgpack_t* mpk, upd_req_t* req) {
   }
 }
 
+static inline void upd_msgpack_resume(upd_msgpack_t* mpk) {
+  while (!mpk->paused && !mpk->accepting && mpk->held.n) {
+    upd_req_t* req = upd_array_remove(&mpk->held, 0);
+    if (HEDLEY_UNLIKELY(!upd_msgpack_accept_(mpk, req))) {
+      req->result = UPD_REQ_NOMEM;
+      req->cb(req);
+    }
+  }
+}
+
+static inline upd_msgpack_inflight_t* upd_msgpack_begin(upd_msgpack_t* mpk) {
+  const size_t max = mpk->maxinflight? mpk->maxinflight: 1;
+  if (HEDLEY_UNLIKELY(mpk->inflight.n >= max)) {
+    return NULL;
+  }
+
+  upd_msgpack_inflight_t* inf = NULL;
+  if (HEDLEY_UNLIKELY(!upd_malloc(&inf, sizeof(*inf)))) {
+    mpk->broken = true;
+    return NULL;
+  }
+  *inf = (upd_msgpack_inflight_t) { .mpk = mpk, };
+  msgpack_unpacked_init(&inf->upkd);
+  msgpack_sbuffer_init(&inf->out);
+  msgpack_packer_init(&inf->pk, &inf->out, msgpack_sbuffer_write);
+
+  if (HEDLEY_UNLIKELY(!upd_msgpack_pop(mpk, &inf->upkd))) {
+    upd_free(&inf);
+    return NULL;
+  }
+  if (HEDLEY_UNLIKELY(!upd_array_insert(&mpk->inflight, inf, SIZE_MAX))) {
+    upd_msgpack_inflight_free_(inf);
+    mpk->broken = true;
+    return NULL;
+  }
+
+  const msgpack_object* root = &inf->upkd.data;
+  if (HEDLEY_LIKELY(root->type == MSGPACK_OBJECT_MAP)) {
+    inf->id = upd_msgpack_find_obj_by_cstr(&root->via.map, "id");
+  }
+  return inf;
+}
+
+static inline msgpack_packer* upd_msgpack_respond(
+    upd_msgpack_inflight_t* inf, size_t n) {
+  upd_msgpack_t* mpk = inf->mpk;
+
+  /* a response can go out directly unless preceding ones are pending */
+  msgpack_packer* pk = &mpk->pk;
+  if (mpk->ordered && mpk->inflight.p[0] != inf) {
+    pk = &inf->pk;
+  }
+
+  if (HEDLEY_UNLIKELY(msgpack_pack_map(pk, n + !!inf->id))) {
+    return NULL;
+  }
+  if (inf->id) {
+    const bool ok =
+      !upd_msgpack_pack_cstr(pk, "id") &&
+      !msgpack_pack_object(pk, *inf->id);
+    if (HEDLEY_UNLIKELY(!ok)) {
+      return NULL;
+    }
+  }
+  return pk;
+}
+
+static inline void upd_msgpack_end(upd_msgpack_inflight_t* inf) {
+  upd_msgpack_t* mpk = inf->mpk;
+
+  const size_t max  = mpk->maxinflight? mpk->maxinflight: 1;
+  const bool   full = mpk->inflight.n >= max;
+
+  inf->done = true;
+  if (mpk->ordered) {
+    while (mpk->inflight.n) {
+      upd_msgpack_inflight_t* head = mpk->inflight.p[0];
+      if (!head->done) {
+        break;
+      }
+      if (head->out.size) {
+        const int ret =
+          mpk->pk.callback(mpk->pk.data, head->out.data, head->out.size);
+        if (HEDLEY_UNLIKELY(ret)) {
+          mpk->broken = true;
+        }
+      }
+      upd_array_remove(&mpk->inflight, 0);
+      upd_msgpack_inflight_free_(head);
+    }
+  } else {
+    upd_array_find_and_remove(&mpk->inflight, inf);
+    upd_msgpack_inflight_free_(inf);
+  }
+
+  /* objects left in the unpacker were not taken because of the limit,
+   * and accept_() calls back by itself after write callbacks return */
+  if (HEDLEY_UNLIKELY(full && mpk->inflight.n < max && !mpk->busy)) {
+    if (!mpk->accepting || mpk->calling) {
+      upd_msgpack_call_(mpk);
+    }
+  }
+  upd_msgpack_resume(mpk);
+}
+
 
 static inline bool upd_msgpack_recv_init(upd_msgpack_recv_t* recv) {
   if (HEDLEY_UNLIKELY(!msgpack_unpacker_init(&recv->upk, 1024))) {
@@ -289,6 +974,12 @@ static inline bool upd_msgpack_recv_init(upd_msgpack_recv_t* recv) {
   }
 
   msgpack_unpacked_init(&recv->upkd);
+  recv->zones = (upd_msgpack_zone_pool_t) { .max = recv->zones.max, };
+  recv->objs  = NULL;
+  recv->objn  = 0;
+  recv->upkds = NULL;
+  recv->upkdn = 0;
+
   upd_file_ref(recv->file);
   return true;
 }
@@ -301,6 +992,15 @@ static inline void upd_msgpack_recv_deinit(upd_msgpack_recv_t* recv) {
 
   msgpack_unpacker_destroy(&recv->upk);
   msgpack_unpacked_destroy(&recv->upkd);
+
+  for (size_t i = 0; i < recv->upkdn; ++i) {
+    msgpack_unpacked_destroy(&recv->upkds[i]);
+  }
+  upd_free(&recv->upkds);
+  upd_free(&recv->objs);
+  upd_msgpack_zone_pool_clear(&recv->zones);
+  recv->upkdn = 0;
+  recv->objn  = 0;
 }
 
 static inline void upd_msgpack_recv_next(upd_msgpack_recv_t* recv) {
@@ -323,6 +1023,59 @@ static inline void upd_msgpack_recv_next(upd_msgpack_recv_t* recv) {
 }
 
 
+static inline bool upd_msgpack_visitor_feed(
+    upd_msgpack_visitor_t* v, const uint8_t* buf, size_t len) {
+  if (HEDLEY_UNLIKELY(v->broken)) {
+    return false;
+  }
+  while (len) {
+    if (v->rest) {
+      const size_t n = v->rest < len? v->rest: len;
+
+      upd_msgpack_event_t* e = &v->body;
+      e->chunk.ptr   = buf;
+      e->chunk.size  = n;
+      e->chunk.tail  = n == v->rest;
+      v->rest       -= n;
+      buf           += n;
+      len           -= n;
+      if (HEDLEY_UNLIKELY(!upd_msgpack_visitor_emit_(v, e))) {
+        return false;
+      }
+      e->chunk.offset += n;
+      if (v->rest == 0 && HEDLEY_UNLIKELY(!upd_msgpack_visitor_done_(v))) {
+        return false;
+      }
+      continue;
+    }
+
+    if (v->headlen == 0) {
+      v->headneed = upd_msgpack_visitor_head_size_(*buf);
+      if (HEDLEY_UNLIKELY(v->headneed == 0)) {
+        v->broken = true;
+        return false;
+      }
+    }
+    size_t n = v->headneed - v->headlen;
+    if (n > len) {
+      n = len;
+    }
+    memcpy(v->head+v->headlen, buf, n);
+    v->headlen += n;
+    buf        += n;
+    len        -= n;
+
+    if (v->headlen == v->headneed) {
+      v->headlen = 0;
+      if (HEDLEY_UNLIKELY(!upd_msgpack_visitor_head_(v))) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+
 static inline const msgpack_object* upd_msgpack_find_obj(
     const msgpack_object_map* map, const msgpack_object* needle) {
   for (size_t i = 0; i < map->size; ++i) {
@@ -364,88 +1117,815 @@ static inline const char* upd_msgpack_find_fields(
       }
       continue;
     }
+    if (HEDLEY_UNLIKELY(!upd_msgpack_field_assign_(f, v))) {
+      return f->name;
+    }
+  }
+  return NULL;
+}
 
-    bool used = false;
-    if (f->any) {
-      *f->any = v;
-      used    = true;
+static inline bool upd_msgpack_fieldset_compile(
+    upd_msgpack_fieldset_t* fs, const upd_msgpack_field_t* f) {
+  upd_str_set_clear(&fs->names);
+  for (; f->name; ++f) {
+    if (HEDLEY_UNLIKELY(!upd_str_set_add(&fs->names, f->name))) {
+      return false;
+    }
+  }
+  fs->compiled = true;
+  return true;
+}
+
+/* walks the map only once, and dispatches each key by its hash */
+static inline const char* upd_msgpack_find_fields_compiled(
+    const msgpack_object_map*  map,
+    upd_msgpack_fieldset_t*    fs,
+    const upd_msgpack_field_t* f) {
+  if (HEDLEY_UNLIKELY(!fs->compiled)) {
+    if (HEDLEY_UNLIKELY(!upd_msgpack_fieldset_compile(fs, f))) {
+      /* neither dup nor unknown is checked without the compiled names */
+      return upd_msgpack_find_fields(map, f);
+    }
+  }
+  const size_t n = fs->names.n;
+
+  const msgpack_object*  inline_v[UPD_MSGPACK_FIELDSET_MAX] = {0};
+  const msgpack_object** v = inline_v;
+  if (HEDLEY_UNLIKELY(n > UPD_MSGPACK_FIELDSET_MAX)) {
+    v = NULL;
+    if (HEDLEY_UNLIKELY(!upd_malloc(&v, n*sizeof(*v)))) {
+      return upd_msgpack_find_fields(map, f);
+    }
+    memset(v, 0, n*sizeof(*v));
+  }
+
+  const char* ret = NULL;
+  for (size_t i = 0; i < map->size; ++i) {
+    const msgpack_object_kv* kv = &map->ptr[i];
+    if (HEDLEY_UNLIKELY(kv->key.type != MSGPACK_OBJECT_STR)) {
+      if (HEDLEY_UNLIKELY(fs->reject_unknown)) {
+        ret = UPD_MSGPACK_FIELD_UNKNOWN;
+        goto EXIT;
+      }
+      continue;
     }
-    switch (v->type) {
-    case MSGPACK_OBJECT_POSITIVE_INTEGER:
-      if (f->ui) {
-        *f->ui = v->via.u64;
-        used   = true;
+    const msgpack_object_str* k = &kv->key.via.str;
+
+    const size_t j = upd_str_set_find(&fs->names, k->ptr, k->size);
+    if (HEDLEY_UNLIKELY(j == SIZE_MAX)) {
+      if (HEDLEY_UNLIKELY(fs->reject_unknown)) {
+        ret = UPD_MSGPACK_FIELD_UNKNOWN;
+        goto EXIT;
       }
-      if (v->via.u64 > INTMAX_MAX) {
-        break;
+      continue;
+    }
+    if (HEDLEY_UNLIKELY(v[j])) {
+      if (HEDLEY_UNLIKELY(fs->reject_dup)) {
+        ret = f[j].name;
+        goto EXIT;
       }
-      HEDLEY_FALL_THROUGH;
+      continue;
+    }
+    v[j] = &kv->val;
+  }
 
-    case MSGPACK_OBJECT_NEGATIVE_INTEGER:
-      if (f->i) {
-        *f->i = v->via.i64;
-        used  = true;
+  for (size_t i = 0; i < n; ++i) {
+    if (HEDLEY_UNLIKELY(v[i] == NULL)) {
+      if (HEDLEY_UNLIKELY(f[i].required)) {
+        ret = f[i].name;
+        goto EXIT;
       }
-      break;
+      continue;
+    }
+    if (HEDLEY_UNLIKELY(!upd_msgpack_field_assign_(&f[i], v[i]))) {
+      ret = f[i].name;
+      goto EXIT;
+    }
+  }
 
-    case MSGPACK_OBJECT_FLOAT32:
-    case MSGPACK_OBJECT_FLOAT64:
-      if (f->f) {
-        *f->f = v->via.f64;
-        used  = true;
+EXIT:
+  if (HEDLEY_UNLIKELY(v != inline_v)) {
+    upd_free(&v);
+  }
+  return ret;
+}
+
+
+static inline int upd_msgpack_pack_cstr(msgpack_packer* pk, const char* v) {
+  const size_t n = utf8size_lazy(v);
+  return
+    msgpack_pack_str(pk, n) ||
+    msgpack_pack_str_body(pk, v, n);
+}
+
+static inline int upd_msgpack_pack_bool(msgpack_packer* pk, bool b) {
+  return (b? msgpack_pack_true: msgpack_pack_false)(pk);
+}
+
+static inline int upd_msgpack_pack_array(
+    msgpack_packer*       pk,
+    upd_msgpack_numeric_t type,
+    const void*           ptr,
+    size_t                n) {
+  const size_t esz = upd_msgpack_numeric_size_(type);
+  if (HEDLEY_UNLIKELY(esz == 0 || n > UINT32_MAX)) {
+    return -1;
+  }
+
+  uint8_t buf[UPD_MSGPACK_PACK_BUF];
+  size_t  len = 0;
+  if (n < 16) {
+    buf[len++] = 0x90 | n;
+  } else if (n <= UINT16_MAX) {
+    buf[len++] = 0xdc;
+    upd_msgpack_put_be_(buf+len, n, 2);
+    len += 2;
+  } else {
+    buf[len++] = 0xdd;
+    upd_msgpack_put_be_(buf+len, n, 4);
+    len += 4;
+  }
+
+  const uint8_t* src = ptr;
+  for (size_t i = 0; i < n; ++i) {
+    if (HEDLEY_UNLIKELY(len+9 > sizeof(buf))) {
+      if (HEDLEY_UNLIKELY(pk->callback(pk->data, (const char*) buf, len))) {
+        return -1;
       }
-      break;
+      len = 0;
+    }
+    len += upd_msgpack_numeric_pack_(buf+len, type, src+i*esz);
+  }
+  return pk->callback(pk->data, (const char*) buf, len);
+}
+
+static inline int upd_msgpack_pack_blob(
+    msgpack_packer*       pk,
+    upd_msgpack_numeric_t type,
+    const void*           ptr,
+    size_t                n) {
+  const size_t esz = upd_msgpack_numeric_size_(type);
+  if (HEDLEY_UNLIKELY(esz == 0 || n > UINT32_MAX/esz)) {
+    return -1;
+  }
+  const size_t size = n*esz;
+
+  uint8_t buf[6];  /* ext header */
+  size_t  len = 0;
+  switch (size) {
+  case 1:  buf[len++] = 0xd4; break;
+  case 2:  buf[len++] = 0xd5; break;
+  case 4:  buf[len++] = 0xd6; break;
+  case 8:  buf[len++] = 0xd7; break;
+  case 16: buf[len++] = 0xd8; break;
+  default:
+    if (size <= UINT8_MAX) {
+      buf[len++] = 0xc7;
+      buf[len++] = size;
+    } else if (size <= UINT16_MAX) {
+      buf[len++] = 0xc8;
+      upd_msgpack_put_be_(buf+len, size, 2);
+      len += 2;
+    } else {
+      buf[len++] = 0xc9;
+      upd_msgpack_put_be_(buf+len, size, 4);
+      len += 4;
+    }
+  }
+  buf[len++] = type;
+
+  /* the host is little endian (checked by CMakeLists.txt) */
+  return
+    pk->callback(pk->data, (const char*) buf, len) ||
+    (size && pk->callback(pk->data, ptr, size));
+}
+
+static inline bool upd_msgpack_unpack_array(
+    const msgpack_object* obj,
+    upd_msgpack_numeric_t type,
+    void*                 dst,
+    size_t*               n) {
+  const size_t esz = upd_msgpack_numeric_size_(type);
+  if (HEDLEY_UNLIKELY(esz == 0)) {
+    return false;
+  }
+  uint8_t* out = dst;
 
-    case MSGPACK_OBJECT_BOOLEAN:
-      if (f->b) {
-        *f->b = v->via.boolean;
-        used  = true;
+  switch (obj->type) {
+  case MSGPACK_OBJECT_ARRAY: {
+    const msgpack_object_array* a = &obj->via.array;
+    if (HEDLEY_UNLIKELY(a->size > *n)) {
+      return false;
+    }
+    for (size_t i = 0; i < a->size; ++i) {
+      if (HEDLEY_UNLIKELY(!upd_msgpack_numeric_unpack_(out+i*esz, type, &a->ptr[i]))) {
+        return false;
       }
+    }
+    *n = a->size;
+  } return true;
+
+  case MSGPACK_OBJECT_BIN: {
+    const msgpack_object_bin* b = &obj->via.bin;
+    if (HEDLEY_UNLIKELY(type != UPD_MSGPACK_U8 || b->size > *n)) {
+      return false;
+    }
+    if (b->size) {
+      memcpy(out, b->ptr, b->size);
+    }
+    *n = b->size;
+  } return true;
+
+  case MSGPACK_OBJECT_EXT: {
+    const msgpack_object_ext* e = &obj->via.ext;
+    if (HEDLEY_UNLIKELY(e->type != (int8_t) type || e->size%esz)) {
+      return false;
+    }
+    const size_t count = e->size/esz;
+    if (HEDLEY_UNLIKELY(count > *n)) {
+      return false;
+    }
+    if (e->size) {
+      memcpy(out, e->ptr, e->size);
+    }
+    *n = count;
+  } return true;
+
+  default:
+    return false;
+  }
+}
+
+
+static inline bool upd_msgpack_field_assign_(
+    const upd_msgpack_field_t* f, const msgpack_object* v) {
+  bool used = false;
+  if (f->any) {
+    *f->any = v;
+    used    = true;
+  }
+  switch (v->type) {
+  case MSGPACK_OBJECT_POSITIVE_INTEGER:
+    if (f->ui) {
+      *f->ui = v->via.u64;
+      used   = true;
+    }
+    if (v->via.u64 > INTMAX_MAX) {
       break;
+    }
+    HEDLEY_FALL_THROUGH;
 
-    case MSGPACK_OBJECT_STR:
-      if (f->str) {
-        *f->str = &v->via.str;
-        used    = true;
-      }
+  case MSGPACK_OBJECT_NEGATIVE_INTEGER:
+    if (f->i) {
+      *f->i = v->via.i64;
+      used  = true;
+    }
+    break;
+
+  case MSGPACK_OBJECT_FLOAT32:
+  case MSGPACK_OBJECT_FLOAT64:
+    if (f->f) {
+      *f->f = v->via.f64;
+      used  = true;
+    }
+    break;
+
+  case MSGPACK_OBJECT_BOOLEAN:
+    if (f->b) {
+      *f->b = v->via.boolean;
+      used  = true;
+    }
+    break;
+
+  case MSGPACK_OBJECT_STR:
+    if (f->str) {
+      *f->str = &v->via.str;
+      used    = true;
+    }
+    break;
+
+  case MSGPACK_OBJECT_MAP:
+    if (f->map) {
+      *f->map = &v->via.map;
+      used    = true;
+    }
+    break;
+
+  case MSGPACK_OBJECT_ARRAY:
+    if (f->array) {
+      *f->array = &v->via.array;
+      used      = true;
+    }
+    break;
+
+  default:
+    break;
+  }
+  return used;
+}
+
+static inline bool upd_msgpack_template_compile(upd_msgpack_template_t* t) {
+  const char* const* keys = t->keys;
+  if (HEDLEY_UNLIKELY(keys == NULL)) {
+    return false;
+  }
+  uint8_t* b   = t->bytes;
+  size_t   len = 0;
+
+  size_t n = 0;
+  while (keys[n]) ++n;
+  if (HEDLEY_UNLIKELY(n > UPD_MSGPACK_TEMPLATE_MAX)) {
+    return false;
+  }
+  if (n < 16) {
+    b[len++] = 0x80 | n;
+  } else {
+    b[len++] = 0xde;
+    upd_msgpack_put_be_(b+len, n, 2);
+    len += 2;
+  }
+
+  t->offs[0] = 0;
+  for (size_t i = 0; i < n; ++i) {
+    const size_t klen = utf8size_lazy(keys[i]);
+    const size_t head = klen < 32? 1: klen <= UINT8_MAX? 2: 3;
+    if (HEDLEY_UNLIKELY(klen > UINT16_MAX || len+head+klen > sizeof(t->bytes))) {
+      return false;
+    }
+    if (klen < 32) {
+      b[len++] = 0xa0 | klen;
+    } else if (klen <= UINT8_MAX) {
+      b[len++] = 0xd9;
+      b[len++] = klen;
+    } else {
+      b[len++] = 0xda;
+      upd_msgpack_put_be_(b+len, klen, 2);
+      len += 2;
+    }
+    memcpy(b+len, keys[i], klen);
+    len += klen;
+    t->offs[i+1] = len;
+  }
+  t->n        = n;
+  t->compiled = true;
+  return true;
+}
+
+static inline const uint8_t* upd_msgpack_template_key(
+    upd_msgpack_template_t* t, size_t i, size_t* size) {
+  if (HEDLEY_UNLIKELY(!t->compiled && !upd_msgpack_template_compile(t))) {
+    return NULL;
+  }
+  assert(i < t->n);
+
+  const size_t off = t->offs[i];
+  *size = t->offs[i+1] - off;
+  return t->bytes + off;
+}
+
+static inline int upd_msgpack_template_pack_key(
+    msgpack_packer* pk, upd_msgpack_template_t* t, size_t i) {
+  size_t         size;
+  const uint8_t* key = upd_msgpack_template_key(t, i, &size);
+  if (HEDLEY_UNLIKELY(key == NULL)) {
+    return -1;
+  }
+  return pk->callback(pk->data, (const char*) key, size);
+}
+
+
+static inline size_t upd_msgpack_numeric_size_(upd_msgpack_numeric_t type) {
+  switch (type) {
+  case UPD_MSGPACK_U8:  return 1;
+  case UPD_MSGPACK_U16: return 2;
+  case UPD_MSGPACK_I32: return 4;
+  case UPD_MSGPACK_F32: return 4;
+  case UPD_MSGPACK_F64: return 8;
+  }
+  return 0;
+}
+
+static inline size_t upd_msgpack_numeric_pack_(
+    uint8_t* p, upd_msgpack_numeric_t type, const uint8_t* src) {
+  uint64_t u = 0;
+  switch (type) {
+  case UPD_MSGPACK_U8: {
+    uint8_t x;
+    memcpy(&x, src, sizeof(x));
+    u = x;
+  } break;
+  case UPD_MSGPACK_U16: {
+    uint16_t x;
+    memcpy(&x, src, sizeof(x));
+    u = x;
+  } break;
+  case UPD_MSGPACK_I32: {
+    int32_t x;
+    memcpy(&x, src, sizeof(x));
+    if (x >= 0) {
+      u = x;
       break;
+    }
+    if (x >= -32) {
+      p[0] = (uint8_t) x;
+      return 1;
+    }
+    if (x >= INT8_MIN) {
+      p[0] = 0xd0;
+      p[1] = (uint8_t) x;
+      return 2;
+    }
+    if (x >= INT16_MIN) {
+      p[0] = 0xd1;
+      upd_msgpack_put_be_(p+1, (uint16_t) x, 2);
+      return 3;
+    }
+    p[0] = 0xd2;
+    upd_msgpack_put_be_(p+1, (uint32_t) x, 4);
+  } return 5;
+  case UPD_MSGPACK_F32: {
+    uint32_t x;
+    memcpy(&x, src, sizeof(x));
+    p[0] = 0xca;
+    upd_msgpack_put_be_(p+1, x, 4);
+  } return 5;
+  case UPD_MSGPACK_F64: {
+    uint64_t x;
+    memcpy(&x, src, sizeof(x));
+    p[0] = 0xcb;
+    upd_msgpack_put_be_(p+1, x, 8);
+  } return 9;
+  }
 
-    case MSGPACK_OBJECT_MAP:
-      if (f->map) {
-        *f->map = &v->via.map;
-        used    = true;
+  if (u < 0x80) {
+    p[0] = u;
+    return 1;
+  }
+  if (u <= UINT8_MAX) {
+    p[0] = 0xcc;
+    p[1] = u;
+    return 2;
+  }
+  if (u <= UINT16_MAX) {
+    p[0] = 0xcd;
+    upd_msgpack_put_be_(p+1, u, 2);
+    return 3;
+  }
+  p[0] = 0xce;
+  upd_msgpack_put_be_(p+1, u, 4);
+  return 5;
+}
+
+static inline bool upd_msgpack_numeric_unpack_(
+    uint8_t* dst, upd_msgpack_numeric_t type, const msgpack_object* v) {
+  switch (v->type) {
+  case MSGPACK_OBJECT_POSITIVE_INTEGER: {
+    const uint64_t u = v->via.u64;
+    switch (type) {
+    case UPD_MSGPACK_U8:
+      if (HEDLEY_UNLIKELY(u > UINT8_MAX)) {
+        return false;
+      }
+      *dst = u;
+      return true;
+    case UPD_MSGPACK_U16: {
+      if (HEDLEY_UNLIKELY(u > UINT16_MAX)) {
+        return false;
+      }
+      const uint16_t x = u;
+      memcpy(dst, &x, sizeof(x));
+    } return true;
+    case UPD_MSGPACK_I32: {
+      if (HEDLEY_UNLIKELY(u > INT32_MAX)) {
+        return false;
+      }
+      const int32_t x = u;
+      memcpy(dst, &x, sizeof(x));
+    } return true;
+    case UPD_MSGPACK_F32: {
+      const float x = u;
+      memcpy(dst, &x, sizeof(x));
+    } return true;
+    case UPD_MSGPACK_F64: {
+      const double x = u;
+      memcpy(dst, &x, sizeof(x));
+    } return true;
+    }
+  } return false;
+
+  case MSGPACK_OBJECT_NEGATIVE_INTEGER: {
+    const int64_t i = v->via.i64;
+    switch (type) {
+    case UPD_MSGPACK_I32: {
+      if (HEDLEY_UNLIKELY(i < INT32_MIN)) {
+        return false;
       }
+      const int32_t x = i;
+      memcpy(dst, &x, sizeof(x));
+    } return true;
+    case UPD_MSGPACK_F32: {
+      const float x = i;
+      memcpy(dst, &x, sizeof(x));
+    } return true;
+    case UPD_MSGPACK_F64: {
+      const double x = i;
+      memcpy(dst, &x, sizeof(x));
+    } return true;
+    default:
+      return false;
+    }
+  }
+
+  case MSGPACK_OBJECT_FLOAT32:
+  case MSGPACK_OBJECT_FLOAT64:
+    switch (type) {
+    case UPD_MSGPACK_F32: {
+      const float x = v->via.f64;
+      memcpy(dst, &x, sizeof(x));
+    } return true;
+    case UPD_MSGPACK_F64:
+      memcpy(dst, &v->via.f64, sizeof(double));
+      return true;
+    default:
+      return false;
+    }
+
+  default:
+    return false;
+  }
+}
+
+static inline void upd_msgpack_put_be_(uint8_t* p, uint64_t v, size_t n) {
+  for (size_t i = n; i > 0; --i) {
+    p[i-1] = v & 0xff;
+    v    >>= 8;
+  }
+}
+
+static inline uint64_t upd_msgpack_be_(const uint8_t* p, size_t n) {
+  uint64_t v = 0;
+  for (size_t i = 0; i < n; ++i) {
+    v = v << 8 | p[i];
+  }
+  return v;
+}
+
+static inline size_t upd_msgpack_visitor_head_size_(uint8_t c) {
+  if (c <= 0xbf || c >= 0xe0) {
+    return 1;  /* fixint, fixmap, fixarray, fixstr */
+  }
+  switch (c) {
+  case 0xc0: case 0xc2: case 0xc3: return 1;
+  case 0xc4: case 0xcc: case 0xd0: case 0xd9: return 2;
+  case 0xc5: case 0xcd: case 0xd1: case 0xda: case 0xdc: case 0xde: return 3;
+  case 0xc6: case 0xca: case 0xce: case 0xd2: case 0xdb: case 0xdd: case 0xdf: return 5;
+  case 0xcb: case 0xcf: case 0xd3: return 9;
+  case 0xc7: return 3;
+  case 0xc8: return 4;
+  case 0xc9: return 6;
+  case 0xd4: case 0xd5: case 0xd6: case 0xd7: case 0xd8: return 2;
+  }
+  return 0;
+}
+
+static inline bool upd_msgpack_visitor_head_(upd_msgpack_visitor_t* v) {
+  const uint8_t  c = v->head[0];
+  const uint8_t* p = v->head+1;
+
+  upd_msgpack_event_t e = {0};
+  size_t body = 0;
+  bool   con  = false;
+
+  if (c <= 0x7f) {
+    e.type = UPD_MSGPACK_EVENT_UINT;
+    e.u    = c;
+  } else if (c <= 0x8f) {
+    e.type = UPD_MSGPACK_EVENT_MAP;
+    e.n    = c & 0x0f;
+    con    = true;
+  } else if (c <= 0x9f) {
+    e.type = UPD_MSGPACK_EVENT_ARRAY;
+    e.n    = c & 0x0f;
+    con    = true;
+  } else if (c <= 0xbf) {
+    e.type = UPD_MSGPACK_EVENT_STR;
+    body   = c & 0x1f;
+  } else if (c >= 0xe0) {
+    e.type = UPD_MSGPACK_EVENT_INT;
+    e.i    = (int8_t) c;
+  } else {
+    switch (c) {
+    case 0xc0:
+      e.type = UPD_MSGPACK_EVENT_NIL;
+      break;
+    case 0xc2:
+    case 0xc3:
+      e.type = UPD_MSGPACK_EVENT_BOOL;
+      e.b    = c == 0xc3;
       break;
 
-    case MSGPACK_OBJECT_ARRAY:
-      if (f->array) {
-        *f->array = &v->via.array;
-        used      = true;
-      }
+    case 0xc4: case 0xc5: case 0xc6:
+      e.type = UPD_MSGPACK_EVENT_BIN;
+      body   = upd_msgpack_be_(p, v->headneed-1);
+      break;
+    case 0xd9: case 0xda: case 0xdb:
+      e.type = UPD_MSGPACK_EVENT_STR;
+      body   = upd_msgpack_be_(p, v->headneed-1);
+      break;
+    case 0xc7: case 0xc8: case 0xc9:
+      e.type      = UPD_MSGPACK_EVENT_EXT;
+      body        = upd_msgpack_be_(p, v->headneed-2);
+      e.chunk.ext = (int8_t) p[v->headneed-2];
+      break;
+    case 0xd4: case 0xd5: case 0xd6: case 0xd7: case 0xd8:
+      e.type      = UPD_MSGPACK_EVENT_EXT;
+      body        = (size_t) 1 << (c - 0xd4);
+      e.chunk.ext = (int8_t) p[0];
       break;
 
-    default:
+    case 0xca: {
+      const uint32_t u = upd_msgpack_be_(p, 4);
+      float f;
+      memcpy(&f, &u, sizeof(f));
+      e.type = UPD_MSGPACK_EVENT_FLOAT;
+      e.f    = f;
+    } break;
+    case 0xcb: {
+      const uint64_t u = upd_msgpack_be_(p, 8);
+      memcpy(&e.f, &u, sizeof(e.f));
+      e.type = UPD_MSGPACK_EVENT_FLOAT;
+    } break;
+
+    case 0xcc: case 0xcd: case 0xce: case 0xcf:
+      e.type = UPD_MSGPACK_EVENT_UINT;
+      e.u    = upd_msgpack_be_(p, v->headneed-1);
+      break;
+    case 0xd0: e.type = UPD_MSGPACK_EVENT_INT; e.i = (int8_t)  p[0];                    break;
+    case 0xd1: e.type = UPD_MSGPACK_EVENT_INT; e.i = (int16_t) upd_msgpack_be_(p, 2);   break;
+    case 0xd2: e.type = UPD_MSGPACK_EVENT_INT; e.i = (int32_t) upd_msgpack_be_(p, 4);   break;
+    case 0xd3: e.type = UPD_MSGPACK_EVENT_INT; e.i = (int64_t) upd_msgpack_be_(p, 8);   break;
+
+    case 0xdc: case 0xdd:
+      e.type = UPD_MSGPACK_EVENT_ARRAY;
+      e.n    = upd_msgpack_be_(p, v->headneed-1);
+      con    = true;
+      break;
+    case 0xde: case 0xdf:
+      e.type = UPD_MSGPACK_EVENT_MAP;
+      e.n    = upd_msgpack_be_(p, v->headneed-1);
+      con    = true;
       break;
+
+    default:
+      assert(false);
+      HEDLEY_UNREACHABLE();
     }
-    if (HEDLEY_UNLIKELY(!used)) {
-      return f->name;
+  }
+
+  switch (e.type) {
+  case UPD_MSGPACK_EVENT_STR:
+  case UPD_MSGPACK_EVENT_BIN:
+  case UPD_MSGPACK_EVENT_EXT:
+    e.chunk.total = body;
+    if (body) {
+      v->body = e;
+      v->rest = body;
+      if (v->depth) {
+        /* key flag must be fixed now since stack may not change until tail */
+        v->body.key   = v->stack[v->depth-1].map && v->stack[v->depth-1].rest%2 == 0;
+        v->body.depth = v->depth;
+      }
+      return true;
     }
+    e.chunk.tail = true;
+    break;
+  default:
+    break;
   }
-  return NULL;
+
+  if (!upd_msgpack_visitor_emit_(v, &e)) {
+    return false;
+  }
+  if (con) {
+    if (e.n) {
+      if (HEDLEY_UNLIKELY(v->depth >= UPD_MSGPACK_VISITOR_DEPTH_MAX)) {
+        v->broken = true;
+        return false;
+      }
+      const bool map = e.type == UPD_MSGPACK_EVENT_MAP;
+      v->stack[v->depth].rest = map? (uint64_t) e.n*2: e.n;
+      v->stack[v->depth].map  = map;
+      ++v->depth;
+      return true;
+    }
+    e.type = e.type == UPD_MSGPACK_EVENT_MAP?
+      UPD_MSGPACK_EVENT_MAP_END: UPD_MSGPACK_EVENT_ARRAY_END;
+    if (!upd_msgpack_visitor_emit_(v, &e)) {
+      return false;
+    }
+  }
+  return upd_msgpack_visitor_done_(v);
 }
 
+static inline bool upd_msgpack_visitor_emit_(
+    upd_msgpack_visitor_t* v, upd_msgpack_event_t* e) {
+  if (e != &v->body) {
+    e->depth = v->depth;
+    e->key   = v->depth && v->stack[v->depth-1].map && v->stack[v->depth-1].rest%2 == 0;
+  }
+  if (HEDLEY_UNLIKELY(!v->cb(v, e))) {
+    v->broken = true;
+    return false;
+  }
+  return true;
+}
 
-static inline int upd_msgpack_pack_cstr(msgpack_packer* pk, const char* v) {
-  const size_t n = utf8size_lazy(v);
-  return
-    msgpack_pack_str(pk, n) ||
-    msgpack_pack_str_body(pk, v, n);
+/* called when a value completes, closes containers filled by the value */
+static inline bool upd_msgpack_visitor_done_(upd_msgpack_visitor_t* v) {
+  while (v->depth) {
+    if (--v->stack[v->depth-1].rest) {
+      return true;
+    }
+    const bool map = v->stack[--v->depth].map;
+
+    upd_msgpack_event_t e = {
+      .type = map? UPD_MSGPACK_EVENT_MAP_END: UPD_MSGPACK_EVENT_ARRAY_END,
+    };
+    if (HEDLEY_UNLIKELY(!upd_msgpack_visitor_emit_(v, &e))) {
+      return false;
+    }
+  }
+  return true;
 }
 
-static inline int upd_msgpack_pack_bool(msgpack_packer* pk, bool b) {
-  return (b? msgpack_pack_true: msgpack_pack_false)(pk);
+static inline void upd_msgpack_inflight_free_(upd_msgpack_inflight_t* inf) {
+  if (inf->upkd.zone) {
+    upd_msgpack_zone_pool_put(&inf->mpk->zones, inf->upkd.zone);
+    inf->upkd.zone = NULL;
+  }
+  msgpack_sbuffer_destroy(&inf->out);
+  upd_free(&inf);
 }
 
+/* The writer is completed before mpk->cb, so completions keep the order of
+ * writes even if mpk->cb pops. Writes and resumes from the callbacks are
+ * deferred to the caller. */
+static inline bool upd_msgpack_accept_(upd_msgpack_t* mpk, upd_req_t* req) {
+  upd_req_stream_io_t* io = &req->stream.io;
+
+  mpk->accepting = true;
+  if (io->reserve) {
+    const size_t len = io->size;
+
+    io->buf = upd_msgpack_reserve(mpk, len);
+    if (HEDLEY_UNLIKELY(io->buf == NULL)) {
+      mpk->accepting = false;
+      return false;
+    }
+    mpk->reserving = true;
+    req->result    = UPD_REQ_OK;
+    req->cb(req);
+    mpk->reserving = false;
+
+    assert(io->size <= len);
+    upd_msgpack_commit(mpk, io->size);
+    if (HEDLEY_UNLIKELY(mpk->highmem && mpk->mem >= mpk->highmem)) {
+      mpk->paused = true;
+    }
+  } else {
+    if (HEDLEY_UNLIKELY(!upd_msgpack_unpack(mpk, io->buf, io->size))) {
+      mpk->accepting = false;
+      return false;
+    }
+    if (HEDLEY_UNLIKELY(mpk->highmem && mpk->mem >= mpk->highmem)) {
+      mpk->paused = true;
+    }
+    req->result = UPD_REQ_OK;
+    req->cb(req);
+  }
+
+  if (HEDLEY_UNLIKELY(!mpk->busy)) {
+    upd_msgpack_call_(mpk);
+  }
+  mpk->accepting = false;
+  return true;
+}
+
+/* calls back again in a loop instead of recursion, so a callback ending
+ * objects synchronously doesn't grow the stack */
+static inline void upd_msgpack_call_(upd_msgpack_t* mpk) {
+  if (HEDLEY_UNLIKELY(mpk->calling)) {
+    mpk->pending = true;
+    return;
+  }
+  mpk->calling = true;
+  do {
+    mpk->pending = false;
+    mpk->cb(mpk);
+  } while (HEDLEY_UNLIKELY(mpk->pending && !mpk->busy));
+  mpk->pending = false;
+  mpk->calling = false;
+}
 
 static inline void upd_msgpack_recv_watch_cb_(upd_file_watch_t* w) {
   upd_msgpack_recv_t* recv = w->udata;
@@ -461,6 +1941,65 @@ static inline void upd_msgpack_recv_watch_cb_(upd_file_watch_t* w) {
   }
 }
 
+static inline void upd_msgpack_recv_drain_(upd_msgpack_recv_t* recv) {
+  size_t n = 0;
+  for (;;) {
+    if (HEDLEY_UNLIKELY(n >= recv->upkdn)) {
+      const size_t cap = recv->upkdn? recv->upkdn*2: 4;
+      if (HEDLEY_UNLIKELY(!upd_malloc(&recv->upkds, cap*sizeof(*recv->upkds)))) {
+        goto ABORT;
+      }
+      if (HEDLEY_UNLIKELY(!upd_malloc(&recv->objs, cap*sizeof(*recv->objs)))) {
+        goto ABORT;
+      }
+      for (size_t i = recv->upkdn; i < cap; ++i) {
+        msgpack_unpacked_init(&recv->upkds[i]);
+      }
+      recv->upkdn = cap;
+    }
+
+    size_t consumed;
+    const int ret = upd_msgpack_next(
+      &recv->upk, &recv->upkds[n], &recv->zones, &consumed);
+    if (HEDLEY_LIKELY(ret == MSGPACK_UNPACK_SUCCESS)) {
+      recv->objs[n] = recv->upkds[n].data;
+      ++n;
+      continue;
+    }
+    if (HEDLEY_UNLIKELY(ret != MSGPACK_UNPACK_CONTINUE)) {
+      goto ABORT;
+    }
+    break;
+  }
+
+  /* releases objects left from the previous batch */
+  for (size_t i = n; i < recv->objn; ++i) {
+    msgpack_unpacked* upkd = &recv->upkds[i];
+    if (upkd->zone) {
+      upd_msgpack_zone_pool_put(&recv->zones, upkd->zone);
+      upkd->zone = NULL;
+    }
+  }
+  recv->objn = n;
+
+  if (HEDLEY_UNLIKELY(n == 0)) {
+    if (recv->pending) {
+      upd_msgpack_recv_next(recv);
+    } else {
+      recv->busy = false;
+    }
+    return;
+  }
+  recv->ok  = true;
+  recv->obj = &recv->objs[0];
+  recv->cb(recv);
+  return;
+
+ABORT:
+  recv->ok = false;
+  recv->cb(recv);
+}
+
 static inline void upd_msgpack_recv_read_cb_(upd_req_t* req) {
   upd_msgpack_recv_t* recv = req->udata;
   recv->reading = false;
@@ -470,13 +2009,35 @@ static inline void upd_msgpack_recv_read_cb_(upd_req_t* req) {
   }
 
   const upd_req_stream_io_t* io = &req->stream.io;
+  if (recv->visitor) {
+    if (HEDLEY_UNLIKELY(io->size == 0)) {
+      if (recv->pending) {
+        upd_msgpack_recv_next(recv);
+      } else {
+        recv->busy = false;
+      }
+      return;
+    }
+    recv->ok  = upd_msgpack_visitor_feed(recv->visitor, io->buf, io->size);
+    recv->obj = NULL;
+    recv->cb(recv);
+    return;
+  }
+
   if (HEDLEY_UNLIKELY(!msgpack_unpacker_reserve_buffer(&recv->upk, io->size))) {
     goto ABORT;
   }
   memcpy(msgpack_unpacker_buffer(&recv->upk), io->buf, io->size);
   msgpack_unpacker_buffer_consumed(&recv->upk, io->size);
 
-  const int ret = msgpack_unpacker_next(&recv->upk, &recv->upkd);
+  if (recv->drain) {
+    upd_msgpack_recv_drain_(recv);
+    return;
+  }
+
+  size_t consumed;
+  const int ret = upd_msgpack_next(
+    &recv->upk, &recv->upkd, &recv->zones, &consumed);
   switch (ret) {
   case MSGPACK_UNPACK_SUCCESS:
     recv->ok  = true;
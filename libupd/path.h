@@ -19,6 +19,21 @@
   "0123456789"  \
   "-_."
 
+#define UPD_PATH_HASH_INIT  UPD_STR_HASH_INIT
+#define UPD_PATH_HASH_PRIME UPD_STR_HASH_PRIME
+
+
+/* tokenizes a path once, yielding each component with its hash */
+typedef struct upd_path_iter_t {
+  const uint8_t* path;
+  size_t         len;
+  size_t         offset;
+
+  const uint8_t* name;
+  size_t         namelen;
+  uint32_t       hash;
+} upd_path_iter_t;
+
 
 static inline
 size_t
@@ -51,6 +66,19 @@ upd_path_basename(
   const uint8_t* path,
   size_t*        len);
 
+static inline
+uint32_t
+upd_path_hash(
+  const uint8_t* name,
+  size_t         len);
+
+HEDLEY_NON_NULL(1)
+HEDLEY_WARN_UNUSED_RESULT
+static inline
+bool
+upd_path_iter_next(
+  upd_path_iter_t* itr);
+
 
 static inline size_t upd_path_normalize(uint8_t* path, size_t len) {
   if (HEDLEY_UNLIKELY(len == 0)) {
@@ -155,3 +183,24 @@ static inline const uint8_t* upd_path_basename(
   *len -= offset;
   return path + offset;
 }
+
+static inline uint32_t upd_path_hash(const uint8_t* name, size_t len) {
+  return upd_str_hash(name, len);
+}
+
+static inline bool upd_path_iter_next(upd_path_iter_t* itr) {
+  const uint8_t* p   = itr->path + itr->offset;
+  const uint8_t* end = itr->path + itr->len;
+
+  while (p < end && *p == '/') ++p;
+  itr->name = p;
+
+  uint32_t h = UPD_PATH_HASH_INIT;
+  for (; p < end && *p != '/'; ++p) {
+    h = (h ^ *p) * UPD_PATH_HASH_PRIME;
+  }
+  itr->namelen = p - itr->name;
+  itr->hash    = h;
+  itr->offset  = p - itr->path;
+  return itr->namelen > 0;
+}
@@ -4,14 +4,91 @@
 #include <stdbool.h>
 #include <stdint.h>
 #include <stddef.h>
+#include <string.h>
 
 #include <hedley.h>
 #include <utf8.h>
 
 #include <libupd.h>
 
+#include "array.h"
+#include "memory.h"
+#include "path.h"
 
-typedef struct upd_pathfind_t upd_pathfind_t;
+
+#define UPD_PATHFIND_CACHE_DEFAULT_MAX 256
+
+
+/* Steps of the pathfind state machine. When a driver completes a lock or
+ * request inline, its callback only sets the sync flag and the step loop
+ * continues, so deep lookups run in constant stack space. */
+enum {
+  UPD_PATHFIND_STEP_NEXT,
+  UPD_PATHFIND_STEP_LOCKED,
+  UPD_PATHFIND_STEP_FIND,
+  UPD_PATHFIND_STEP_FOUND,
+  UPD_PATHFIND_STEP_ADDED,
+  UPD_PATHFIND_STEP_ADDED_PATH,
+};
+
+
+typedef struct upd_pathfind_t             upd_pathfind_t;
+typedef struct upd_pathfind_cache_t       upd_pathfind_cache_t;
+typedef struct upd_pathfind_cache_entry_t upd_pathfind_cache_entry_t;
+typedef struct upd_pathfind_cache_dir_t   upd_pathfind_cache_dir_t;
+typedef struct upd_pathfind_many_t        upd_pathfind_many_t;
+typedef struct upd_pathfind_many_item_t   upd_pathfind_many_item_t;
+typedef struct upd_pathfind_many_node_t   upd_pathfind_many_node_t;
+
+/* maps (base file id, path) to a file,
+ * THIS OBJECT HOLDS FILE REFCNT OF ALL CACHED FILES AND WATCHED DIRS */
+struct upd_pathfind_cache_t {
+  /* filled by user */
+  size_t max;
+
+  /* read-only stats */
+  uint64_t hits;
+  uint64_t misses;
+
+  /* used internally */
+  size_t   n;
+  uint64_t gen;
+
+  size_t                       bucketn;
+  upd_pathfind_cache_entry_t** buckets;
+
+  upd_pathfind_cache_entry_t* head;  /* most recently used */
+  upd_pathfind_cache_entry_t* tail;  /* least recently used */
+
+  /* watched dirs keyed by file, sharing bucketn with the entries */
+  upd_pathfind_cache_dir_t** dirs;
+  size_t                     idle;  /* dirs left with no users */
+};
+
+struct upd_pathfind_cache_entry_t {
+  upd_pathfind_cache_entry_t* chain;
+  upd_pathfind_cache_entry_t* prev;
+  upd_pathfind_cache_entry_t* next;
+
+  upd_file_id_t base;
+  upd_file_t*   file;
+  uint64_t      gen;
+
+  upd_array_of(upd_pathfind_cache_dir_t*) dirs;
+
+  uint32_t hash;
+  size_t   len;
+  uint8_t  path[];
+};
+
+struct upd_pathfind_cache_dir_t {
+  upd_pathfind_cache_dir_t* chain;
+  upd_pathfind_cache_t*     cache;
+  upd_file_watch_t          watch;
+  size_t                    users;
+
+  unsigned firing : 1;
+};
 
 struct upd_pathfind_t {
   upd_iso_t*  iso;
@@ -20,8 +97,21 @@ struct upd_pathfind_t {
   const uint8_t* path;
   size_t         len;
   size_t         term;
+  uint32_t       hash;
 
   bool create;
+  bool newpath;  /* with create, makes all missing dirs by one UPD_REQ_DIR_NEWPATH */
+
+  upd_pathfind_cache_t* cache;
+
+  /* used internally */
+  upd_pathfind_cache_entry_t* cache_entry;
+
+  uint8_t* npath;  /* normalized rest of path for UPD_REQ_DIR_NEWPATH */
+
+  uint8_t  step;
+  unsigned calling : 1;
+  unsigned sync    : 1;
 
   upd_req_t       req;
   upd_file_lock_t lock;
@@ -35,9 +125,100 @@ struct upd_pathfind_t {
 };
 
 
+struct upd_pathfind_many_item_t {
+  /* filled by user */
+  const uint8_t* path;
+  size_t         len;
+
+  /* filled by upd_pathfind_many, NULL if not found */
+  upd_file_t* file;
+};
+
+struct upd_pathfind_many_node_t {
+  upd_pathfind_many_node_t* child;
+  upd_pathfind_many_node_t* sibling;
+
+  const uint8_t* name;
+  size_t         len;
+  uint32_t       hash;
+
+  upd_file_t* file;
+};
+
+/* resolves all items at once, visiting each directory only once */
+struct upd_pathfind_many_t {
+  /* filled by user */
+  upd_iso_t*  iso;
+  upd_file_t* base;
+
+  upd_pathfind_many_item_t* items;
+  size_t                    n;
+
+  void* udata;
+  void
+  (*cb)(
+    upd_pathfind_many_t* pfm);
+
+  /* used internally */
+  upd_pathfind_many_node_t*  nodes;
+  upd_pathfind_many_node_t** leaves;
+  upd_pathfind_many_node_t** queue;
+  size_t                     qhead;
+  size_t                     qtail;
+
+  upd_pathfind_many_node_t* dir;
+  upd_pathfind_many_node_t* child;
+
+  uint8_t  step;
+  unsigned calling : 1;
+  unsigned sync    : 1;
+
+  upd_req_t       req;
+  upd_file_lock_t lock;
+};
+
+
+HEDLEY_NON_NULL(1)
+HEDLEY_WARN_UNUSED_RESULT
+static inline
+bool
+upd_pathfind_cache_init(
+  upd_pathfind_cache_t* c);
+
+HEDLEY_NON_NULL(1)
+static inline
+void
+upd_pathfind_cache_deinit(
+  upd_pathfind_cache_t* c);
+
+HEDLEY_NON_NULL(1)
+static inline
+void
+upd_pathfind_cache_clear(
+  upd_pathfind_cache_t* c);
+
+
+HEDLEY_NON_NULL(1)
+HEDLEY_WARN_UNUSED_RESULT
+static inline
+bool
+upd_pathfind_many(
+  upd_pathfind_many_t* pfm);
+
+
 static
 void
-upd_pathfind_next_(
+upd_pathfind_run_(
+  upd_pathfind_t* pf);
+
+static
+bool
+upd_pathfind_step_(
+  upd_pathfind_t* pf);
+
+static
+void
+upd_pathfind_finish_(
   upd_pathfind_t* pf);
 
 static
@@ -47,12 +228,84 @@ upd_pathfind_lock_cb_(
 
 static
 void
-upd_pathfind_find_cb_(
+upd_pathfind_req_cb_(
   upd_req_t* req);
 
+
+static inline
+bool
+upd_pathfind_cache_lookup_(
+  upd_pathfind_t* pf);
+
+static inline
+void
+upd_pathfind_cache_track_(
+  upd_pathfind_t* pf);
+
+static inline
+void
+upd_pathfind_cache_commit_(
+  upd_pathfind_t* pf);
+
+static inline
+void
+upd_pathfind_cache_discard_(
+  upd_pathfind_cache_t*       c,
+  upd_pathfind_cache_entry_t* e);
+
+static inline
+void
+upd_pathfind_cache_evict_(
+  upd_pathfind_cache_t*       c,
+  upd_pathfind_cache_entry_t* e);
+
+static inline
+upd_pathfind_cache_dir_t**
+upd_pathfind_cache_dir_bucket_(
+  upd_pathfind_cache_t* c,
+  const upd_file_t*     f);
+
+static inline
+void
+upd_pathfind_cache_unuse_(
+  upd_pathfind_cache_t*     c,
+  upd_pathfind_cache_dir_t* d);
+
+static inline
+void
+upd_pathfind_cache_release_(
+  upd_pathfind_cache_t*     c,
+  upd_pathfind_cache_dir_t* d);
+
+static inline
+void
+upd_pathfind_cache_gc_(
+  upd_pathfind_cache_t* c);
+
+static inline
+void
+upd_pathfind_cache_watch_cb_(
+  upd_file_watch_t* w);
+
+
 static
 void
-upd_pathfind_add_cb_(
+upd_pathfind_many_run_(
+  upd_pathfind_many_t* pfm);
+
+static
+bool
+upd_pathfind_many_step_(
+  upd_pathfind_many_t* pfm);
+
+static
+void
+upd_pathfind_many_lock_cb_(
+  upd_file_lock_t* lock);
+
+static
+void
+upd_pathfind_many_find_cb_(
   upd_req_t* req);
 
 
@@ -67,7 +320,14 @@ static inline void upd_pathfind(upd_pathfind_t* pf) {
   if (!pf->iso) {
     pf->iso = pf->base->iso;
   }
-  upd_pathfind_next_(pf);
+  pf->cache_entry = NULL;
+  if (pf->cache && upd_pathfind_cache_lookup_(pf)) {
+    pf->cb(pf);
+    return;
+  }
+  pf->step    = UPD_PATHFIND_STEP_NEXT;
+  pf->calling = false;
+  upd_pathfind_run_(pf);
 }
 
 HEDLEY_NON_NULL(1)
@@ -90,104 +350,725 @@ static inline upd_pathfind_t* upd_pathfind_with_dup(const upd_pathfind_t* src) {
 }
 
 
-static void upd_pathfind_next_(upd_pathfind_t* pf) {
-  while (pf->len && pf->path[0] == '/') {
-    ++pf->path;
-    --pf->len;
+static inline bool upd_pathfind_cache_init(upd_pathfind_cache_t* c) {
+  if (!c->max) {
+    c->max = UPD_PATHFIND_CACHE_DEFAULT_MAX;
   }
-  pf->term = 0;
-  while (pf->term < pf->len && pf->path[pf->term] != '/') {
-    ++pf->term;
+
+  size_t n = 1;
+  while (n < c->max) n <<= 1;
+
+  const size_t size = n*(sizeof(*c->buckets) + sizeof(*c->dirs));
+
+  c->buckets = NULL;
+  if (HEDLEY_UNLIKELY(!upd_malloc(&c->buckets, size))) {
+    return false;
   }
-  if (!pf->base) {
-    pf->base = upd_file_get(pf->iso, UPD_FILE_ID_ROOT);
+  memset(c->buckets, 0, size);
+
+  c->bucketn = n;
+  c->n       = 0;
+  c->gen     = 0;
+  c->hits    = 0;
+  c->misses  = 0;
+  c->head    = NULL;
+  c->tail    = NULL;
+  c->dirs    = (upd_pathfind_cache_dir_t**) (c->buckets + n);
+  c->idle    = 0;
+  return true;
+}
+
+static inline void upd_pathfind_cache_deinit(upd_pathfind_cache_t* c) {
+  upd_pathfind_cache_clear(c);
+  upd_free(&c->buckets);
+}
+
+static inline void upd_pathfind_cache_clear(upd_pathfind_cache_t* c) {
+  while (c->head) {
+    upd_pathfind_cache_evict_(c, c->head);
   }
-  if (!pf->len) {
-    pf->cb(pf);
-    return;
+  ++c->gen;
+  upd_pathfind_cache_gc_(c);
+}
+
+
+static inline bool upd_pathfind_many(upd_pathfind_many_t* pfm) {
+  assert(pfm->iso || pfm->base);
+  if (!pfm->iso) {
+    pfm->iso = pfm->base->iso;
+  }
+  upd_file_t* root = upd_file_get(pfm->iso, UPD_FILE_ID_ROOT);
+  if (!pfm->base) {
+    pfm->base = root;
   }
 
-  pf->lock = (upd_file_lock_t) {
-    .file  = pf->base,
-    .udata = pf,
-    .cb    = upd_pathfind_lock_cb_,
-  };
-  if (HEDLEY_UNLIKELY(!upd_file_lock(&pf->lock))) {
-    pf->cb(pf);
-    return;
+  /* two trie roots: one for relative paths and one for absolute paths */
+  size_t nodes = 2;
+  for (size_t i = 0; i < pfm->n; ++i) {
+    const upd_pathfind_many_item_t* item = &pfm->items[i];
+
+    upd_path_iter_t itr = { .path = item->path, .len = item->len, };
+    while (upd_path_iter_next(&itr)) {
+      ++nodes;
+    }
   }
-}
 
-static inline void upd_pathfind_lock_cb_(upd_file_lock_t* lock) {
-  upd_pathfind_t* pf = lock->udata;
+  const size_t size =
+    nodes*sizeof(*pfm->nodes) +
+    nodes*sizeof(*pfm->queue) +
+    pfm->n*sizeof(*pfm->leaves);
+  pfm->nodes = upd_iso_stack(pfm->iso, size);
+  if (HEDLEY_UNLIKELY(pfm->nodes == NULL)) {
+    return false;
+  }
+  pfm->queue  = (upd_pathfind_many_node_t**) (pfm->nodes + nodes);
+  pfm->leaves = pfm->queue + nodes;
+  pfm->qhead  = 0;
+  pfm->qtail  = 0;
 
-  if (HEDLEY_UNLIKELY(!lock->ok)) {
-    goto ABORT;
+  upd_pathfind_many_node_t* rel = &pfm->nodes[0];
+  upd_pathfind_many_node_t* abs = &pfm->nodes[1];
+  *rel = (upd_pathfind_many_node_t) { .file = pfm->base, };
+  *abs = (upd_pathfind_many_node_t) { .file = root, };
+  if (pfm->base == root) {
+    abs = rel;
   }
-  pf->req = (upd_req_t) {
-    .file = pf->base,
-    .type = UPD_REQ_DIR_FIND,
-    .dir  = { .entry = {
-      .name = (uint8_t*) pf->path,
-      .len  = pf->term,
-    }, },
-    .udata = pf,
-    .cb    = upd_pathfind_find_cb_,
-  };
-  if (HEDLEY_UNLIKELY(!upd_req(&pf->req))) {
-    goto ABORT;
+
+  size_t used = 2;
+  for (size_t i = 0; i < pfm->n; ++i) {
+    const upd_pathfind_many_item_t* item = &pfm->items[i];
+
+    upd_pathfind_many_node_t* cur =
+      item->len && item->path[0] == '/'? abs: rel;
+
+    upd_path_iter_t itr = { .path = item->path, .len = item->len, };
+    while (upd_path_iter_next(&itr)) {
+      upd_pathfind_many_node_t* c = cur->child;
+      for (; c; c = c->sibling) {
+        if (c->hash == itr.hash && upd_streq(c->name, c->len, itr.name, itr.namelen)) {
+          break;
+        }
+      }
+      if (c == NULL) {
+        c  = &pfm->nodes[used++];
+        *c = (upd_pathfind_many_node_t) {
+          .sibling = cur->child,
+          .name    = itr.name,
+          .len     = itr.namelen,
+          .hash    = itr.hash,
+        };
+        cur->child = c;
+      }
+      cur = c;
+    }
+    pfm->leaves[i] = cur;
   }
-  return;
 
-ABORT:
-  upd_file_unlock(&pf->lock);
-  pf->cb(pf);
+  if (rel->child) {
+    pfm->queue[pfm->qtail++] = rel;
+  }
+  if (abs != rel && abs->child) {
+    pfm->queue[pfm->qtail++] = abs;
+  }
+  pfm->step    = UPD_PATHFIND_STEP_NEXT;
+  pfm->calling = false;
+  upd_pathfind_many_run_(pfm);
+  return true;
 }
 
-static void upd_pathfind_find_cb_(upd_req_t* req) {
-  upd_pathfind_t* pf = req->udata;
 
-  if (HEDLEY_UNLIKELY(req->dir.entry.file == NULL)) {
-    if (pf->create) {
+static void upd_pathfind_run_(upd_pathfind_t* pf) {
+  while (upd_pathfind_step_(pf));
+}
+
+/* returns false when pf is waiting for a callback or has been finished */
+static bool upd_pathfind_step_(upd_pathfind_t* pf) {
+  bool ok = false;
+
+  switch (pf->step) {
+  case UPD_PATHFIND_STEP_NEXT: {
+    upd_path_iter_t itr = {
+      .path = pf->path,
+      .len  = pf->len,
+    };
+    const bool more = upd_path_iter_next(&itr);
+
+    pf->len -= itr.name - pf->path;
+    pf->path = itr.name;
+    pf->term = itr.namelen;
+    pf->hash = itr.hash;
+    if (!more) {
+      pf->len = 0;
+    }
+    if (!pf->base) {
+      pf->base = upd_file_get(pf->iso, UPD_FILE_ID_ROOT);
+    }
+    if (!pf->len) {
+      upd_pathfind_finish_(pf);
+      return false;
+    }
+
+    pf->lock = (upd_file_lock_t) {
+      .file  = pf->base,
+      .udata = pf,
+      .cb    = upd_pathfind_lock_cb_,
+    };
+    pf->step    = UPD_PATHFIND_STEP_LOCKED;
+    pf->sync    = false;
+    pf->calling = true;
+    ok = upd_file_lock(&pf->lock);
+    pf->calling = false;
+    if (HEDLEY_UNLIKELY(!ok)) {
+      upd_pathfind_finish_(pf);
+      return false;
+    }
+  } return pf->sync;
+
+  case UPD_PATHFIND_STEP_LOCKED:
+    if (HEDLEY_UNLIKELY(!pf->lock.ok)) {
+      goto ABORT;
+    }
+    pf->req = (upd_req_t) {
+      .file = pf->base,
+      .type = UPD_REQ_DIR_FIND,
+      .dir  = { .entry = {
+        .name   = (uint8_t*) pf->path,
+        .len    = pf->term,
+        .hash   = pf->hash,
+        .hashed = true,
+      }, },
+      .udata = pf,
+      .cb    = upd_pathfind_req_cb_,
+    };
+    pf->step    = UPD_PATHFIND_STEP_FOUND;
+    pf->sync    = false;
+    pf->calling = true;
+    ok = upd_req(&pf->req);
+    pf->calling = false;
+    if (HEDLEY_UNLIKELY(!ok)) {
+      goto ABORT;
+    }
+    return pf->sync;
+
+  case UPD_PATHFIND_STEP_FOUND:
+    if (HEDLEY_UNLIKELY(pf->req.dir.entry.file == NULL)) {
+      if (!pf->create) {
+        goto ABORT;
+      }
+      if (pf->newpath) {
+        /* the driver never sees empty components */
+        pf->npath = upd_iso_stack(pf->iso, pf->len);
+        if (HEDLEY_UNLIKELY(pf->npath == NULL)) {
+          goto ABORT;
+        }
+        size_t len = 0;
+
+        upd_path_iter_t itr = { .path = pf->path, .len = pf->len, };
+        while (upd_path_iter_next(&itr)) {
+          if (len) {
+            pf->npath[len++] = '/';
+          }
+          utf8ncpy(pf->npath+len, itr.name, itr.namelen);
+          len += itr.namelen;
+        }
+
+        pf->req = (upd_req_t) {
+          .file = pf->base,
+          .type = UPD_REQ_DIR_NEWPATH,
+          .dir  = { .entry = {
+            .name = pf->npath,
+            .len  = len,
+          }, },
+          .udata = pf,
+          .cb    = upd_pathfind_req_cb_,
+        };
+        pf->step    = UPD_PATHFIND_STEP_ADDED_PATH;
+        pf->sync    = false;
+        pf->calling = true;
+        ok = upd_req(&pf->req);
+        pf->calling = false;
+        if (HEDLEY_LIKELY(ok)) {
+          return pf->sync;
+        }
+        upd_iso_unstack(pf->iso, pf->npath);
+        pf->npath = NULL;
+        /* the driver doesn't support NEWPATH, so falls back to NEWDIR */
+      }
       pf->req = (upd_req_t) {
         .file = pf->base,
         .type = UPD_REQ_DIR_NEWDIR,
         .dir  = { .entry = {
-          .name = (uint8_t*) pf->path,
-          .len  = pf->term,
+          .name   = (uint8_t*) pf->path,
+          .len    = pf->term,
+          .hash   = pf->hash,
+          .hashed = true,
         }, },
         .udata = pf,
-        .cb    = upd_pathfind_add_cb_,
+        .cb    = upd_pathfind_req_cb_,
       };
-      const bool newdir = upd_req(&pf->req);
-      if (HEDLEY_LIKELY(newdir)) {
-        return;
+      pf->step    = UPD_PATHFIND_STEP_ADDED;
+      pf->sync    = false;
+      pf->calling = true;
+      ok = upd_req(&pf->req);
+      pf->calling = false;
+      if (HEDLEY_UNLIKELY(!ok)) {
+        goto ABORT;
       }
+      return pf->sync;
+    }
+    break;
+
+  case UPD_PATHFIND_STEP_ADDED:
+    if (HEDLEY_UNLIKELY(pf->req.result != UPD_REQ_OK)) {
+      goto ABORT;
+    }
+    break;
+
+  case UPD_PATHFIND_STEP_ADDED_PATH:
+    upd_iso_unstack(pf->iso, pf->npath);
+    pf->npath = NULL;
+    if (HEDLEY_UNLIKELY(pf->req.result != UPD_REQ_OK)) {
+      goto ABORT;
     }
     upd_file_unlock(&pf->lock);
-    pf->cb(pf);
-    return;
+
+    /* dirs made by the driver are not watched, so don't cache the result */
+    if (pf->cache_entry) {
+      upd_pathfind_cache_discard_(pf->cache, pf->cache_entry);
+      pf->cache_entry = NULL;
+    }
+    pf->base  = pf->req.dir.entry.file;
+    pf->path += pf->len;
+    pf->len   = 0;
+    pf->step  = UPD_PATHFIND_STEP_NEXT;
+    return true;
+
+  default:
+    assert(false);
+    HEDLEY_UNREACHABLE();
   }
 
   upd_file_unlock(&pf->lock);
-  pf->base  = req->dir.entry.file;
+  upd_pathfind_cache_track_(pf);
+  pf->base  = pf->req.dir.entry.file;
   pf->path += pf->term;
   pf->len  -= pf->term;
-  upd_pathfind_next_(pf);
+  pf->step  = UPD_PATHFIND_STEP_NEXT;
+  return true;
+
+ABORT:
+  upd_file_unlock(&pf->lock);
+  upd_pathfind_finish_(pf);
+  return false;
+}
+
+static void upd_pathfind_finish_(upd_pathfind_t* pf) {
+  if (pf->cache_entry) {
+    if (HEDLEY_LIKELY(!pf->len)) {
+      upd_pathfind_cache_commit_(pf);
+    } else {
+      upd_pathfind_cache_discard_(pf->cache, pf->cache_entry);
+    }
+    pf->cache_entry = NULL;
+  }
+  pf->cb(pf);
 }
 
-static void upd_pathfind_add_cb_(upd_req_t* req) {
+static void upd_pathfind_lock_cb_(upd_file_lock_t* lock) {
+  upd_pathfind_t* pf = lock->udata;
+  if (pf->calling) {
+    pf->sync = true;
+    return;
+  }
+  upd_pathfind_run_(pf);
+}
+
+static void upd_pathfind_req_cb_(upd_req_t* req) {
   upd_pathfind_t* pf = req->udata;
+  if (pf->calling) {
+    pf->sync = true;
+    return;
+  }
+  upd_pathfind_run_(pf);
+}
 
-  upd_file_unlock(&pf->lock);
 
-  if (HEDLEY_UNLIKELY(req->result != UPD_REQ_OK)) {
-    pf->cb(pf);
+static inline bool upd_pathfind_cache_lookup_(upd_pathfind_t* pf) {
+  upd_pathfind_cache_t* c = pf->cache;
+  upd_pathfind_cache_gc_(c);
+
+  /* key is the path with empty components removed */
+  uint8_t key[UPD_PATH_MAX];
+  size_t  len = 0;
+
+  upd_path_iter_t itr = { .path = pf->path, .len = pf->len, };
+  while (upd_path_iter_next(&itr)) {
+    if (HEDLEY_UNLIKELY(len+!!len+itr.namelen > sizeof(key))) {
+      return false;
+    }
+    if (len) {
+      key[len++] = '/';
+    }
+    utf8ncpy(key+len, itr.name, itr.namelen);
+    len += itr.namelen;
+  }
+  if (HEDLEY_UNLIKELY(len == 0)) {
+    return false;
+  }
+
+  const upd_file_id_t base = pf->base->id;
+
+  uint32_t hash = upd_path_hash(key, len);
+  hash = (hash ^ (uint32_t) (base ^ base >> 32)) * UPD_PATH_HASH_PRIME;
+
+  upd_pathfind_cache_entry_t* e = c->buckets[hash & (c->bucketn-1)];
+  for (; e; e = e->chain) {
+    if (e->hash == hash && e->base == base && upd_streq(e->path, e->len, key, len)) {
+      break;
+    }
+  }
+
+  if (HEDLEY_LIKELY(e)) {
+    ++c->hits;
+    if (e != c->head) {
+      e->prev->next = e->next;
+      if (e->next) {
+        e->next->prev = e->prev;
+      } else {
+        c->tail = e->prev;
+      }
+      e->prev       = NULL;
+      e->next       = c->head;
+      c->head->prev = e;
+      c->head       = e;
+    }
+    pf->base  = e->file;
+    pf->path += pf->len;
+    pf->len   = 0;
+    return true;
+  }
+  ++c->misses;
+
+  if (HEDLEY_UNLIKELY(!upd_malloc(&e, sizeof(*e)+len))) {
+    return false;
+  }
+  *e = (upd_pathfind_cache_entry_t) {
+    .base = base,
+    .gen  = c->gen,
+    .hash = hash,
+    .len  = len,
+  };
+  utf8ncpy(e->path, key, len);
+  pf->cache_entry = e;
+  return false;
+}
+
+static inline void upd_pathfind_cache_track_(upd_pathfind_t* pf) {
+  upd_pathfind_cache_t*       c = pf->cache;
+  upd_pathfind_cache_entry_t* e = pf->cache_entry;
+  if (e == NULL) {
     return;
   }
 
-  pf->base  = req->dir.entry.file;
-  pf->path += pf->term;
-  pf->len  -= pf->term;
-  upd_pathfind_next_(pf);
+  upd_pathfind_cache_dir_t** b = upd_pathfind_cache_dir_bucket_(c, pf->base);
+  upd_pathfind_cache_dir_t*  d = *b;
+  while (d && d->watch.file != pf->base) {
+    d = d->chain;
+  }
+
+  if (d == NULL) {
+    if (HEDLEY_UNLIKELY(!upd_malloc(&d, sizeof(*d)))) {
+      goto ABORT;
+    }
+    *d = (upd_pathfind_cache_dir_t) {
+      .chain = *b,
+      .cache = c,
+      .watch = {
+        .file  = pf->base,
+        .udata = d,
+        .cb    = upd_pathfind_cache_watch_cb_,
+      },
+    };
+    if (HEDLEY_UNLIKELY(!upd_file_watch(&d->watch))) {
+      upd_free(&d);
+      goto ABORT;
+    }
+    upd_file_ref(pf->base);
+    *b = d;
+  } else if (HEDLEY_UNLIKELY(d->users == 0)) {
+    --c->idle;
+  }
+
+  ++d->users;
+  if (HEDLEY_UNLIKELY(!upd_array_insert(&e->dirs, d, SIZE_MAX))) {
+    upd_pathfind_cache_unuse_(c, d);
+    goto ABORT;
+  }
+  return;
+
+ABORT:
+  upd_pathfind_cache_discard_(c, e);
+  pf->cache_entry = NULL;
+}
+
+static inline void upd_pathfind_cache_commit_(upd_pathfind_t* pf) {
+  upd_pathfind_cache_t*       c = pf->cache;
+  upd_pathfind_cache_entry_t* e = pf->cache_entry;
+
+  /* a watched dir has been modified while walking */
+  if (HEDLEY_UNLIKELY(e->gen != c->gen)) {
+    upd_pathfind_cache_discard_(c, e);
+    return;
+  }
+
+  /* another walk on the same key finished first */
+  upd_pathfind_cache_entry_t** b = &c->buckets[e->hash & (c->bucketn-1)];
+  for (upd_pathfind_cache_entry_t* x = *b; x; x = x->chain) {
+    if (x->hash == e->hash && x->base == e->base &&
+        upd_streq(x->path, x->len, e->path, e->len)) {
+      upd_pathfind_cache_discard_(c, e);
+      return;
+    }
+  }
+
+  while (c->n >= c->max && c->tail) {
+    upd_pathfind_cache_evict_(c, c->tail);
+  }
+
+  e->file  = pf->base;
+  e->chain = *b;
+  *b       = e;
+
+  e->prev = NULL;
+  e->next = c->head;
+  if (c->head) {
+    c->head->prev = e;
+  } else {
+    c->tail = e;
+  }
+  c->head = e;
+  ++c->n;
+
+  upd_file_ref(e->file);
+}
+
+static inline void upd_pathfind_cache_discard_(
+    upd_pathfind_cache_t* c, upd_pathfind_cache_entry_t* e) {
+  for (size_t i = 0; i < e->dirs.n; ++i) {
+    upd_pathfind_cache_unuse_(c, e->dirs.p[i]);
+  }
+  upd_array_clear(&e->dirs);
+  upd_free(&e);
+}
+
+static inline void upd_pathfind_cache_evict_(
+    upd_pathfind_cache_t* c, upd_pathfind_cache_entry_t* e) {
+  upd_pathfind_cache_entry_t** b = &c->buckets[e->hash & (c->bucketn-1)];
+  while (*b != e) {
+    b = &(*b)->chain;
+  }
+  *b = e->chain;
+
+  if (e->prev) {
+    e->prev->next = e->next;
+  } else {
+    c->head = e->next;
+  }
+  if (e->next) {
+    e->next->prev = e->prev;
+  } else {
+    c->tail = e->prev;
+  }
+  --c->n;
+
+  upd_file_unref(e->file);
+  upd_pathfind_cache_discard_(c, e);
+}
+
+static inline upd_pathfind_cache_dir_t** upd_pathfind_cache_dir_bucket_(
+    upd_pathfind_cache_t* c, const upd_file_t* f) {
+  const upd_file_id_t id = f->id;
+  const uint32_t hash = (uint32_t) (id ^ id >> 32) * UPD_PATH_HASH_PRIME;
+  return &c->dirs[hash & (c->bucketn-1)];
+}
+
+/* A dir is released as soon as its last user goes away, except the one whose
+ * watch callback is running, which cannot remove itself safely. That one is
+ * left idle for upd_pathfind_cache_gc_(). */
+static inline void upd_pathfind_cache_unuse_(
+    upd_pathfind_cache_t* c, upd_pathfind_cache_dir_t* d) {
+  assert(d->users);
+  if (HEDLEY_LIKELY(--d->users)) {
+    return;
+  }
+  if (HEDLEY_UNLIKELY(d->firing)) {
+    ++c->idle;
+    return;
+  }
+  upd_pathfind_cache_release_(c, d);
+}
+
+static inline void upd_pathfind_cache_release_(
+    upd_pathfind_cache_t* c, upd_pathfind_cache_dir_t* d) {
+  upd_pathfind_cache_dir_t** b = upd_pathfind_cache_dir_bucket_(c, d->watch.file);
+  while (*b != d) {
+    b = &(*b)->chain;
+  }
+  *b = d->chain;
+
+  upd_file_unwatch(&d->watch);
+  upd_file_unref(d->watch.file);
+  upd_free(&d);
+}
+
+static inline void upd_pathfind_cache_gc_(upd_pathfind_cache_t* c) {
+  for (size_t i = 0; c->idle && i < c->bucketn; ++i) {
+    upd_pathfind_cache_dir_t* d = c->dirs[i];
+    while (d) {
+      upd_pathfind_cache_dir_t* next = d->chain;
+      if (HEDLEY_UNLIKELY(d->users == 0 && !d->firing)) {
+        --c->idle;
+        upd_pathfind_cache_release_(c, d);
+      }
+      d = next;
+    }
+  }
+}
+
+static inline void upd_pathfind_cache_watch_cb_(upd_file_watch_t* w) {
+  upd_pathfind_cache_dir_t* d = w->udata;
+  upd_pathfind_cache_t*     c = d->cache;
+
+  switch (w->event) {
+  case UPD_FILE_UPDATE:
+  case UPD_FILE_DELETE:
+    break;
+  default:
+    return;
+  }
+  ++c->gen;
+
+  d->firing = true;
+  upd_pathfind_cache_entry_t* e = c->head;
+  while (e) {
+    upd_pathfind_cache_entry_t* next = e->next;
+
+    size_t i;
+    if (HEDLEY_UNLIKELY(upd_array_find(&e->dirs, &i, d))) {
+      upd_pathfind_cache_evict_(c, e);
+    }
+    e = next;
+  }
+  d->firing = false;
+}
+
+
+static void upd_pathfind_many_run_(upd_pathfind_many_t* pfm) {
+  while (upd_pathfind_many_step_(pfm));
+}
+
+/* returns false when pfm is waiting for a callback or has been finished */
+static bool upd_pathfind_many_step_(upd_pathfind_many_t* pfm) {
+  bool ok = false;
+
+  switch (pfm->step) {
+  case UPD_PATHFIND_STEP_NEXT:
+    while (pfm->qhead < pfm->qtail) {
+      pfm->dir   = pfm->queue[pfm->qhead++];
+      pfm->child = pfm->dir->child;
+
+      pfm->lock = (upd_file_lock_t) {
+        .file  = pfm->dir->file,
+        .udata = pfm,
+        .cb    = upd_pathfind_many_lock_cb_,
+      };
+      pfm->step    = UPD_PATHFIND_STEP_LOCKED;
+      pfm->sync    = false;
+      pfm->calling = true;
+      ok = upd_file_lock(&pfm->lock);
+      pfm->calling = false;
+      if (HEDLEY_LIKELY(ok)) {
+        return pfm->sync;
+      }
+    }
+
+    for (size_t i = 0; i < pfm->n; ++i) {
+      pfm->items[i].file = pfm->leaves[i]->file;
+    }
+    upd_iso_unstack(pfm->iso, pfm->nodes);
+    pfm->nodes = NULL;
+    pfm->cb(pfm);
+    return false;
+
+  case UPD_PATHFIND_STEP_LOCKED:
+    if (HEDLEY_UNLIKELY(!pfm->lock.ok)) {
+      upd_file_unlock(&pfm->lock);
+      pfm->step = UPD_PATHFIND_STEP_NEXT;
+      return true;
+    }
+    pfm->step = UPD_PATHFIND_STEP_FIND;
+    return true;
+
+  case UPD_PATHFIND_STEP_FIND:
+    for (; pfm->child; pfm->child = pfm->child->sibling) {
+      upd_pathfind_many_node_t* c = pfm->child;
+
+      pfm->req = (upd_req_t) {
+        .file = pfm->dir->file,
+        .type = UPD_REQ_DIR_FIND,
+        .dir  = { .entry = {
+          .name   = (uint8_t*) c->name,
+          .len    = c->len,
+          .hash   = c->hash,
+          .hashed = true,
+        }, },
+        .udata = pfm,
+        .cb    = upd_pathfind_many_find_cb_,
+      };
+      pfm->step    = UPD_PATHFIND_STEP_FOUND;
+      pfm->sync    = false;
+      pfm->calling = true;
+      ok = upd_req(&pfm->req);
+      pfm->calling = false;
+      if (HEDLEY_LIKELY(ok)) {
+        return pfm->sync;
+      }
+    }
+    upd_file_unlock(&pfm->lock);
+    pfm->step = UPD_PATHFIND_STEP_NEXT;
+    return true;
+
+  case UPD_PATHFIND_STEP_FOUND: {
+    upd_pathfind_many_node_t* c = pfm->child;
+
+    c->file = pfm->req.dir.entry.file;
+    if (c->file && c->child) {
+      pfm->queue[pfm->qtail++] = c;
+    }
+    pfm->child = c->sibling;
+    pfm->step  = UPD_PATHFIND_STEP_FIND;
+  } return true;
+
+  default:
+    assert(false);
+    HEDLEY_UNREACHABLE();
+  }
+}
+
+static void upd_pathfind_many_lock_cb_(upd_file_lock_t* lock) {
+  upd_pathfind_many_t* pfm = lock->udata;
+  if (pfm->calling) {
+    pfm->sync = true;
+    return;
+  }
+  upd_pathfind_many_run_(pfm);
+}
+
+static void upd_pathfind_many_find_cb_(upd_req_t* req) {
+  upd_pathfind_many_t* pfm = req->udata;
+  if (pfm->calling) {
+    pfm->sync = true;
+    return;
+  }
+  upd_pathfind_many_run_(pfm);
 }
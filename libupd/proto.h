@@ -9,16 +9,44 @@
 
 #include <libupd.h>
 
+#include "msgpack.h"
 #include "pathfind.h"
 #include "str.h"
+#include "tensor.h"
 
 
 #define UPD_PROTO_PARSE_HOLD_MAX 4
 
+#define UPD_PROTO_TENSOR_RANK_MAX 8
+
+#define UPD_PROTO_DISPATCH_MAX 16  /* interfaces */
+
+#define UPD_PROTO_PARSE_POOL_MAX     64
+#define UPD_PROTO_PARSE_POOL_DEFAULT 8
+
+#define UPD_PROTO_PIPELINE_MAX 64
+
+#define UPD_PROTO_OBJPATH_DEFAULT 16
+#define UPD_PROTO_OBJPATH_KEY_MAX 64
+
 
 typedef struct upd_proto_msg_t   upd_proto_msg_t;
 typedef struct upd_proto_parse_t upd_proto_parse_t;
 
+typedef struct upd_proto_parse_pool_t upd_proto_parse_pool_t;
+
+typedef struct upd_proto_pipeline_t      upd_proto_pipeline_t;
+typedef struct upd_proto_pipeline_slot_t upd_proto_pipeline_slot_t;
+
+typedef struct upd_proto_batch_t upd_proto_batch_t;
+
+typedef struct upd_proto_objpath_t       upd_proto_objpath_t;
+typedef struct upd_proto_objpath_entry_t upd_proto_objpath_entry_t;
+
+typedef struct upd_proto_cmd_def_t   upd_proto_cmd_def_t;
+typedef struct upd_proto_iface_def_t upd_proto_iface_def_t;
+typedef struct upd_proto_dispatch_t  upd_proto_dispatch_t;
+
 
 typedef enum upd_proto_iface_t {
   UPD_PROTO_ENCODER = 0x0001,
@@ -30,6 +58,7 @@ typedef enum upd_proto_cmd_t {
   UPD_PROTO_ENCODER_INIT,
   UPD_PROTO_ENCODER_FRAME,
   UPD_PROTO_ENCODER_FINALIZE,
+  UPD_PROTO_ENCODER_FRAMES,
 
   UPD_PROTO_OBJECT_LOCK,
   UPD_PROTO_OBJECT_LOCKEX,
@@ -45,9 +74,17 @@ struct upd_proto_msg_t {
   const msgpack_object_map* param;
 
   union {
+    /* file is NULL if the frame carries tensor inline,
+     * whose data points into the msg zone and may be unaligned,
+     * and whose reso is alive as long as the memory of par */
     struct {
-      upd_file_t* file;
+      upd_file_t*           file;
+      upd_req_tensor_data_t tensor;
     } encoder_frame;
+    struct {
+      upd_file_t** files;
+      size_t       n;
+    } encoder_frames;
     struct {
       const msgpack_object_array* path;
       const msgpack_object*       value;
@@ -56,11 +93,47 @@ struct upd_proto_msg_t {
 };
 
 
+struct upd_proto_cmd_def_t {
+  const char* name;
+  int         cmd;  /* stored to upd_proto_msg_t.cmd */
+};
+
+/* An interface is matched case-insensitively and its commands
+ * case-sensitively. Names must be ASCII. */
+struct upd_proto_iface_def_t {
+  const char*                name;
+  upd_proto_iface_t          iface;  /* a bit tested with upd_proto_parse_t.iface */
+  const upd_proto_cmd_def_t* cmds;   /* terminated by NULL name */
+
+  /* called after msg->iface and msg->cmd are filled, can be NULL */
+  void
+  (*parse)(
+    upd_proto_parse_t* par);
+};
+
+/* Hashed names of interfaces, each followed by hashed names of its commands,
+ * built once and placed in static storage usually. */
+struct upd_proto_dispatch_t {
+  upd_str_set_t ifaces;
+  struct {
+    const upd_proto_iface_def_t* def;
+    upd_str_set_t                cmds;  /* indices of def->cmds */
+  } entries[UPD_PROTO_DISPATCH_MAX];
+};
+
+
 struct upd_proto_parse_t {
   upd_iso_t*            iso;
   const msgpack_object* src;
   upd_proto_iface_t     iface;
 
+  /* NULL means the built-in interfaces */
+  const upd_proto_dispatch_t* dispatch;
+
+  /* If true, the callback doesn't free par and refs held by par are kept
+   * until upd_proto_parse_release(), which must be called then. */
+  bool defer;
+
   size_t          refcnt;
   upd_proto_msg_t msg;
 
@@ -68,6 +141,12 @@ struct upd_proto_parse_t {
 
   upd_file_t* hold[UPD_PROTO_PARSE_HOLD_MAX];
 
+  /* used internally */
+  upd_array_of(upd_file_t*) holds;  /* refs beyond hold */
+  void*                     mem;    /* freed after the callback */
+  upd_proto_parse_pool_t*   pool;   /* par returns here after the callback */
+  upd_pathfind_t            pf;
+
   void* udata;
   void
   (*cb)(
@@ -75,6 +154,140 @@ struct upd_proto_parse_t {
 };
 
 
+/* Parse contexts released by their callbacks are kept here to be reused,
+ * usually one pool per iso. */
+struct upd_proto_parse_pool_t {
+  /* filled by user */
+  size_t max;  /* zero means UPD_PROTO_PARSE_POOL_DEFAULT */
+
+  /* read-only stats */
+  size_t   inuse;
+  size_t   highwater;  /* max of inuse */
+  uint64_t allocs;     /* number of contexts taken from heap */
+
+  /* used internally */
+  size_t             n;
+  upd_proto_parse_t* items[UPD_PROTO_PARSE_POOL_MAX];
+};
+
+
+struct upd_proto_pipeline_slot_t {
+  upd_proto_parse_t     par;  /* parsed with defer */
+  upd_proto_pipeline_t* pl;
+  void*                 udata;
+  bool                  done;
+};
+
+/* Parses up to depth encoder messages concurrently and passes the results
+ * to the callback in order of submission,
+ * THIS OBJECT HOLDS FILE REFCNT OF TARGETS UNTIL THE CALLBACK RETURNS */
+struct upd_proto_pipeline_t {
+  /* filled by user */
+  upd_iso_t*                  iso;
+  size_t                      depth;  /* zero means 1 */
+  const upd_proto_dispatch_t* dispatch;
+
+  void* udata;
+  void
+  (*cb)(
+    upd_proto_pipeline_t* pl);
+
+  /* available in the callback */
+  const upd_proto_msg_t* msg;
+  const char*            err;
+  void*                  item;  /* udata passed to submit */
+
+  /* used internally */
+  upd_proto_pipeline_slot_t* slots;
+  size_t                     head;
+  size_t                     n;
+  bool                       flushing;
+};
+
+
+/* Parses {"batch": [msg, ...], "strict": bool} at once. All results come
+ * in one callback. A strict batch consists of only object commands and
+ * is rejected entirely if any of them is invalid. This only parses, and
+ * nothing is rolled back when applying a command fails: how to apply the
+ * commands and answer them is up to the driver. */
+struct upd_proto_batch_t {
+  /* filled by user */
+  upd_iso_t*                  iso;
+  const msgpack_object*       src;
+  upd_proto_iface_t           iface;
+  const upd_proto_dispatch_t* dispatch;
+
+  void* udata;
+  void
+  (*cb)(
+    upd_proto_batch_t* b);
+
+  /* filled by upd_proto_batch_parse(), pars are released after the callback */
+  const char*        err;
+  bool               strict;
+  size_t             n;
+  upd_proto_parse_t* pars;
+
+  /* used internally */
+  size_t refcnt;
+};
+
+struct upd_proto_objpath_entry_t {
+  uint64_t gen;
+  uint32_t hash;
+  uint8_t  len;
+  uint8_t  key[UPD_PROTO_OBJPATH_KEY_MAX];
+  void*    handle;
+};
+
+/* Direct-mapped cache from paths of OBJECT GET/SET to handles of the
+ * driver's object model, usually one per connection. Paths that are too
+ * long or have segments other than strings and integers are not cached. */
+struct upd_proto_objpath_t {
+  /* filled by user */
+  size_t max;  /* number of slots, zero means UPD_PROTO_OBJPATH_DEFAULT */
+
+  void* udata;
+  void*  /* NULL if not found */
+  (*resolve)(
+    upd_proto_objpath_t*        op,
+    const msgpack_object_array* path);
+
+  /* read-only stats */
+  uint64_t hits;
+  uint64_t misses;
+
+  /* used internally */
+  uint64_t                   gen;
+  upd_proto_objpath_entry_t* entries;
+};
+
+
+/* Initializes the table with the built-in interfaces. */
+HEDLEY_NON_NULL(1)
+static inline
+void
+upd_proto_dispatch_init(
+  upd_proto_dispatch_t* d);
+
+HEDLEY_NON_NULL(1)
+static inline
+void
+upd_proto_dispatch_deinit(
+  upd_proto_dispatch_t* d);
+
+/* Adds the interface with all its commands, or nothing if it returns false.
+ * The definition must outlive the table. Returns false if the table is
+ * full, the interface name is taken or not ASCII, a command is duplicated,
+ * or allocation fails. */
+HEDLEY_NON_NULL(1, 2)
+HEDLEY_WARN_UNUSED_RESULT
+static inline
+bool
+upd_proto_dispatch_add(
+  upd_proto_dispatch_t*        d,
+  const upd_proto_iface_def_t* def);
+
 HEDLEY_NON_NULL(1)
 static inline
 void
@@ -87,9 +300,99 @@ bool
 upd_proto_parse_with_dup(
   const upd_proto_parse_t* src);
 
+/* Works like upd_proto_parse_with_dup() but takes the copy from the pool.
+ * The copy goes back to the pool after the callback, or by
+ * upd_proto_parse_release() with defer, so the callback must not free it. */
+HEDLEY_NON_NULL(1, 2)
+HEDLEY_WARN_UNUSED_RESULT
+static inline
+bool
+upd_proto_parse_with_pool(
+  upd_proto_parse_pool_t*  pool,
+  const upd_proto_parse_t* src);
+
+HEDLEY_NON_NULL(1)
+static inline
+void
+upd_proto_parse_pool_clear(
+  upd_proto_parse_pool_t* pool);
+
+/* Releases refs and memory held by par parsed with defer, and returns par
+ * to its pool if it's taken from one. */
+HEDLEY_NON_NULL(1)
+static inline
+void
+upd_proto_parse_release(
+  upd_proto_parse_t* par);
+
+HEDLEY_NON_NULL(1)
+static inline
+void
+upd_proto_batch_parse(
+  upd_proto_batch_t* b);
+
+HEDLEY_NON_NULL(1)
+HEDLEY_WARN_UNUSED_RESULT
+static inline
+bool
+upd_proto_pipeline_init(
+  upd_proto_pipeline_t* pl);
+
+HEDLEY_NON_NULL(1)
+static inline
+void
+upd_proto_pipeline_deinit(
+  upd_proto_pipeline_t* pl);
+
+HEDLEY_NON_NULL(1)
+HEDLEY_WARN_UNUSED_RESULT
+static inline
+bool
+upd_proto_objpath_init(
+  upd_proto_objpath_t* op);
+
+HEDLEY_NON_NULL(1)
+static inline
+void
+upd_proto_objpath_deinit(
+  upd_proto_objpath_t* op);
+
+/* Returns a handle of the path resolved once before, or resolves it. */
+HEDLEY_NON_NULL(1, 2)
+HEDLEY_WARN_UNUSED_RESULT
+static inline
+void*
+upd_proto_objpath_find(
+  upd_proto_objpath_t*        op,
+  const msgpack_object_array* path);
 
+/* Drops all entries. Call this when the object model is updated. */
+HEDLEY_NON_NULL(1)
 static inline
 void
+upd_proto_objpath_invalidate(
+  upd_proto_objpath_t* op);
+
+/* Starts parsing src, whose zone must be alive until the callback.
+ * Returns false if depth messages are already in flight,
+ * counting the one being passed to the callback. */
+HEDLEY_NON_NULL(1, 2)
+HEDLEY_WARN_UNUSED_RESULT
+static inline
+bool
+upd_proto_pipeline_submit(
+  upd_proto_pipeline_t* pl,
+  const msgpack_object* src,
+  void*                 item);
+
+
+static inline
+const upd_proto_dispatch_t*
+upd_proto_dispatch_default_(
+  void);
+
+static inline
+bool
 upd_proto_parse_hold_(
   upd_proto_parse_t* par,
   upd_file_t*        f);
@@ -99,6 +402,44 @@ void
 upd_proto_parse_unref_(
   upd_proto_parse_t* par);
 
+static inline
+void
+upd_proto_parse_pool_put_(
+  upd_proto_parse_pool_t* pool,
+  upd_proto_parse_t*      par);
+
+static inline
+bool
+upd_proto_parse_tensor_(
+  upd_proto_parse_t*        par,
+  const msgpack_object_map* map);
+
+static inline
+void
+upd_proto_batch_parse_cb_(
+  upd_proto_parse_t* par);
+
+static inline
+void
+upd_proto_batch_unref_(
+  upd_proto_batch_t* b);
+
+static inline
+size_t
+upd_proto_objpath_key_(
+  uint8_t*                    key,
+  const msgpack_object_array* path);
+
+static inline
+void
+upd_proto_pipeline_parse_cb_(
+  upd_proto_parse_t* par);
+
+static inline
+void
+upd_proto_pipeline_flush_(
+  upd_proto_pipeline_t* pl);
+
 
 static inline
 void
@@ -111,6 +452,95 @@ upd_proto_parse_object_(
   upd_proto_parse_t* par);
 
 
+static inline void upd_proto_dispatch_init(upd_proto_dispatch_t* d) {
+  static const upd_proto_cmd_def_t encoder_cmds[] = {
+    { .name = "info",     .cmd = UPD_PROTO_ENCODER_INFO,     },
+    { .name = "init",     .cmd = UPD_PROTO_ENCODER_INIT,     },
+    { .name = "frame",    .cmd = UPD_PROTO_ENCODER_FRAME,    },
+    { .name = "finalize", .cmd = UPD_PROTO_ENCODER_FINALIZE, },
+    { .name = "frames",   .cmd = UPD_PROTO_ENCODER_FRAMES,   },
+    { NULL, },
+  };
+  static const upd_proto_iface_def_t encoder = {
+    .name  = "encoder",
+    .iface = UPD_PROTO_ENCODER,
+    .cmds  = encoder_cmds,
+    .parse = upd_proto_parse_encoder_,
+  };
+
+  static const upd_proto_cmd_def_t object_cmds[] = {
+    { .name = "lock",   .cmd = UPD_PROTO_OBJECT_LOCK,   },
+    { .name = "lockex", .cmd = UPD_PROTO_OBJECT_LOCKEX, },
+    { .name = "unlock", .cmd = UPD_PROTO_OBJECT_UNLOCK, },
+    { .name = "get",    .cmd = UPD_PROTO_OBJECT_GET,    },
+    { .name = "set",    .cmd = UPD_PROTO_OBJECT_SET,    },
+    { NULL, },
+  };
+  static const upd_proto_iface_def_t object = {
+    .name  = "object",
+    .iface = UPD_PROTO_OBJECT,
+    .cmds  = object_cmds,
+    .parse = upd_proto_parse_object_,
+  };
+
+  *d = (upd_proto_dispatch_t) {0};
+
+  const bool ok =
+    upd_proto_dispatch_add(d, &encoder) &&
+    upd_proto_dispatch_add(d, &object);
+  assert(ok);
+  (void) ok;
+}
+
+static inline void upd_proto_dispatch_deinit(upd_proto_dispatch_t* d) {
+  for (size_t i = 0; i < d->ifaces.n; ++i) {
+    upd_str_set_clear(&d->entries[i].cmds);
+  }
+  upd_str_set_clear(&d->ifaces);
+}
+
+static inline bool upd_proto_dispatch_add(
+    upd_proto_dispatch_t* d, const upd_proto_iface_def_t* def) {
+  const size_t ilen = utf8size_lazy(def->name);
+
+  /* the set folds ASCII only, so matches the same as upd_strcaseq() */
+  for (size_t i = 0; i < ilen; ++i) {
+    if (HEDLEY_UNLIKELY(def->name[i] & 0x80)) {
+      return false;
+    }
+  }
+  d->ifaces.caseless = true;
+
+  const size_t n = d->ifaces.n;
+  if (HEDLEY_UNLIKELY(n >= UPD_PROTO_DISPATCH_MAX)) {
+    return false;
+  }
+  if (HEDLEY_UNLIKELY(upd_str_set_find(&d->ifaces, def->name, ilen) != SIZE_MAX)) {
+    return false;
+  }
+
+  upd_str_set_t cmds = {0};
+  for (const upd_proto_cmd_def_t* c = def->cmds; c->name; ++c) {
+    const size_t clen = utf8size_lazy(c->name);
+    if (HEDLEY_UNLIKELY(upd_str_set_find(&cmds, c->name, clen) != SIZE_MAX)) {
+      goto ABORT;
+    }
+    if (HEDLEY_UNLIKELY(!upd_str_set_add(&cmds, c->name))) {
+      goto ABORT;
+    }
+  }
+  if (HEDLEY_UNLIKELY(!upd_str_set_add(&d->ifaces, def->name))) {
+    goto ABORT;
+  }
+  d->entries[n].def  = def;
+  d->entries[n].cmds = cmds;
+  return true;
+
+ABORT:
+  upd_str_set_clear(&cmds);
+  return false;
+}
+
 static inline void upd_proto_parse(upd_proto_parse_t* par) {
   ++par->refcnt;
 
@@ -122,10 +552,12 @@ static inline void upd_proto_parse(upd_proto_parse_t* par) {
   }
   const msgpack_object_map* root = &par->src->via.map;
 
+  static upd_msgpack_fieldset_t fs = {0};
+
   const msgpack_object_str* iface = NULL;
   const msgpack_object_str* cmd   = NULL;
   const msgpack_object_map* param = NULL;
-  const char* invalid = upd_msgpack_find_fields(root, (upd_msgpack_field_t[]) {
+  const char* invalid = upd_msgpack_find_fields_compiled(root, &fs, (upd_msgpack_field_t[]) {
       { .name = "interface", .required = true,  .str = &iface, },
       { .name = "command",   .required = true,  .str = &cmd,   },
       { .name = "param",     .required = false, .map = &param, },
@@ -137,53 +569,26 @@ static inline void upd_proto_parse(upd_proto_parse_t* par) {
   }
   msg->param = param;
 
-  if (HEDLEY_UNLIKELY(par->iface & UPD_PROTO_ENCODER)) {
-    if (HEDLEY_UNLIKELY(upd_strcaseq_c("encoder", iface->ptr, iface->size))) {
-      msg->iface = UPD_PROTO_ENCODER;
-
-      const upd_str_switch_case_t* c =
-        upd_str_switch((uint8_t*) cmd->ptr, cmd->size, (upd_str_switch_case_t[]) {
-            { .str = "info",     .i = UPD_PROTO_ENCODER_INFO,     },
-            { .str = "init",     .i = UPD_PROTO_ENCODER_INIT,     },
-            { .str = "frame",    .i = UPD_PROTO_ENCODER_FRAME,    },
-            { .str = "finalize", .i = UPD_PROTO_ENCODER_FINALIZE, },
-            { NULL, },
-          });
-      if (HEDLEY_UNLIKELY(c == NULL)) {
-        par->err = "unknown command";
-        goto EXIT;
-      }
-      msg->cmd = c->i;
+  const upd_proto_dispatch_t* d =
+    par->dispatch? par->dispatch: upd_proto_dispatch_default_();
 
-      upd_proto_parse_encoder_(par);
-      goto EXIT;
-    }
+  const size_t i = upd_str_set_find(&d->ifaces, iface->ptr, iface->size);
+  if (HEDLEY_UNLIKELY(i == SIZE_MAX || !(par->iface & d->entries[i].def->iface))) {
+    par->err = "unknown interface";
+    goto EXIT;
   }
-  if (HEDLEY_UNLIKELY(par->iface & UPD_PROTO_OBJECT)) {
-    if (HEDLEY_UNLIKELY(upd_strcaseq_c("object", iface->ptr, iface->size))) {
-      msg->iface = UPD_PROTO_OBJECT;
-
-      const upd_str_switch_case_t* c =
-        upd_str_switch((uint8_t*) cmd->ptr, cmd->size, (upd_str_switch_case_t[]) {
-            { .str = "lock",   .i = UPD_PROTO_OBJECT_LOCK,   },
-            { .str = "lockex", .i = UPD_PROTO_OBJECT_LOCKEX, },
-            { .str = "unlock", .i = UPD_PROTO_OBJECT_UNLOCK, },
-            { .str = "get",    .i = UPD_PROTO_OBJECT_GET,    },
-            { .str = "set",    .i = UPD_PROTO_OBJECT_SET,    },
-            { NULL, },
-          });
-      if (HEDLEY_UNLIKELY(c == NULL)) {
-        par->err = "unknown command";
-        goto EXIT;
-      }
-      msg->cmd = c->i;
+  const upd_proto_iface_def_t* def = d->entries[i].def;
 
-      upd_proto_parse_object_(par);
-      goto EXIT;
-    }
+  const size_t j = upd_str_set_find(&d->entries[i].cmds, cmd->ptr, cmd->size);
+  if (HEDLEY_UNLIKELY(j == SIZE_MAX)) {
+    par->err = "unknown command";
+    goto EXIT;
+  }
+  msg->iface = def->iface;
+  msg->cmd   = def->cmds[j].cmd;
+  if (def->parse) {
+    def->parse(par);
   }
-
-  par->err = "unknown interface";
 
 EXIT:
   upd_proto_parse_unref_(par);
@@ -202,53 +607,515 @@ static inline bool upd_proto_parse_with_dup(const upd_proto_parse_t* src) {
   return true;
 }
 
+static inline bool upd_proto_parse_with_pool(
+    upd_proto_parse_pool_t* pool, const upd_proto_parse_t* src) {
+  upd_proto_parse_t* par = NULL;
+  if (HEDLEY_LIKELY(pool->n)) {
+    par = pool->items[--pool->n];
+  } else {
+    if (HEDLEY_UNLIKELY(!upd_malloc(&par, sizeof(*par)))) {
+      return false;
+    }
+    ++pool->allocs;
+  }
+  if (HEDLEY_UNLIKELY(++pool->inuse > pool->highwater)) {
+    pool->highwater = pool->inuse;
+  }
+
+  *par = *src;
+  par->pool = pool;
+
+  upd_proto_parse(par);
+  return true;
+}
+
+static inline void upd_proto_parse_pool_clear(upd_proto_parse_pool_t* pool) {
+  while (pool->n) {
+    upd_free(&pool->items[--pool->n]);
+  }
+}
+
+static inline void upd_proto_parse_release(upd_proto_parse_t* par) {
+  for (size_t i = 0; i < UPD_PROTO_PARSE_HOLD_MAX; ++i) {
+    if (HEDLEY_UNLIKELY(par->hold[i])) {
+      upd_file_unref(par->hold[i]);
+      par->hold[i] = NULL;
+    }
+  }
+  for (size_t i = 0; i < par->holds.n; ++i) {
+    upd_file_unref(par->holds.p[i]);
+  }
+  upd_array_clear(&par->holds);
+  upd_free(&par->mem);
+
+  if (par->pool) {
+    upd_proto_parse_pool_put_(par->pool, par);
+  }
+}
+
+
+static inline void upd_proto_batch_parse(upd_proto_batch_t* b) {
+  b->refcnt = 1;
+  b->err    = NULL;
+  b->strict = false;
+  b->n      = 0;
+  b->pars   = NULL;
 
-static inline void upd_proto_parse_hold_(
+  if (HEDLEY_UNLIKELY(b->src->type != MSGPACK_OBJECT_MAP)) {
+    b->err = "root must be a map";
+    goto EXIT;
+  }
+
+  static upd_msgpack_fieldset_t fs = {0};
+
+  const msgpack_object_array* cmds = NULL;
+  const char* invalid =
+    upd_msgpack_find_fields_compiled(&b->src->via.map, &fs, (upd_msgpack_field_t[]) {
+        { .name = "batch",  .required = true, .array = &cmds,     },
+        { .name = "strict",                   .b     = &b->strict, },
+        { NULL, },
+      });
+  if (HEDLEY_UNLIKELY(invalid)) {
+    b->err = "invalid msg";
+    goto EXIT;
+  }
+  if (HEDLEY_UNLIKELY(cmds->size == 0)) {
+    goto EXIT;
+  }
+
+  if (HEDLEY_UNLIKELY(!upd_malloc(&b->pars, cmds->size*sizeof(*b->pars)))) {
+    b->err = "nomem";
+    goto EXIT;
+  }
+  b->n = cmds->size;
+
+  /* all must be ready before any completes */
+  for (size_t i = 0; i < b->n; ++i) {
+    b->pars[i] = (upd_proto_parse_t) {
+      .iso      = b->iso,
+      .src      = &cmds->ptr[i],
+      .iface    = b->strict? b->iface & UPD_PROTO_OBJECT: b->iface,
+      .dispatch = b->dispatch,
+      .defer    = true,
+      .udata    = b,
+      .cb       = upd_proto_batch_parse_cb_,
+    };
+  }
+  for (size_t i = 0; i < b->n; ++i) {
+    ++b->refcnt;
+    upd_proto_parse(&b->pars[i]);
+  }
+
+EXIT:
+  upd_proto_batch_unref_(b);
+}
+
+
+static inline bool upd_proto_pipeline_init(upd_proto_pipeline_t* pl) {
+  if (pl->depth == 0) {
+    pl->depth = 1;
+  }
+  if (HEDLEY_UNLIKELY(pl->depth > UPD_PROTO_PIPELINE_MAX)) {
+    return false;
+  }
+  pl->slots = NULL;
+  if (HEDLEY_UNLIKELY(!upd_malloc(&pl->slots, pl->depth*sizeof(*pl->slots)))) {
+    return false;
+  }
+  pl->head     = 0;
+  pl->n        = 0;
+  pl->flushing = false;
+  return true;
+}
+
+static inline void upd_proto_pipeline_deinit(upd_proto_pipeline_t* pl) {
+  assert(pl->n == 0);
+  upd_free(&pl->slots);
+}
+
+static inline bool upd_proto_pipeline_submit(
+    upd_proto_pipeline_t* pl, const msgpack_object* src, void* item) {
+  if (HEDLEY_UNLIKELY(pl->n >= pl->depth)) {
+    return false;
+  }
+  upd_proto_pipeline_slot_t* slot = &pl->slots[(pl->head + pl->n++) % pl->depth];
+
+  *slot = (upd_proto_pipeline_slot_t) {
+    .pl    = pl,
+    .udata = item,
+    .par   = {
+      .iso      = pl->iso,
+      .src      = src,
+      .iface    = UPD_PROTO_ENCODER,
+      .dispatch = pl->dispatch,
+      .defer    = true,
+      .udata    = slot,
+      .cb       = upd_proto_pipeline_parse_cb_,
+    },
+  };
+  upd_proto_parse(&slot->par);
+  return true;
+}
+
+
+static inline const upd_proto_dispatch_t* upd_proto_dispatch_default_(void) {
+  static upd_proto_dispatch_t d  = {0};
+  static bool                 ok = false;
+  if (HEDLEY_UNLIKELY(!ok)) {
+    upd_proto_dispatch_init(&d);
+    ok = true;
+  }
+  return &d;
+}
+
+static inline bool upd_proto_parse_hold_(
     upd_proto_parse_t* par, upd_file_t* f) {
   for (size_t i = 0; i < UPD_PROTO_PARSE_HOLD_MAX; ++i) {
     if (HEDLEY_LIKELY(par->hold[i] == NULL)) {
       par->hold[i] = f;
       upd_file_ref(f);
-      return;
+      return true;
     }
   }
-  assert(false);
-  HEDLEY_UNREACHABLE();
+  if (HEDLEY_UNLIKELY(!upd_array_insert(&par->holds, f, SIZE_MAX))) {
+    return false;
+  }
+  upd_file_ref(f);
+  return true;
 }
 
 static inline void upd_proto_parse_unref_(upd_proto_parse_t* par) {
   if (HEDLEY_LIKELY(--par->refcnt)) {
     return;
   }
+  if (HEDLEY_UNLIKELY(par->defer)) {
+    par->cb(par);
+    return;
+  }
 
   upd_file_t* hold[UPD_PROTO_PARSE_HOLD_MAX];
   memcpy(hold, par->hold, sizeof(hold));
 
+  upd_array_t holds = par->holds;
+  void*       mem   = par->mem;
+
+  upd_proto_parse_pool_t* pool = par->pool;
+
   par->cb(par);  /* par is freed and not available anymore */
 
+  if (pool) {
+    upd_proto_parse_pool_put_(pool, par);
+  }
+
   for (size_t i = 0; i < UPD_PROTO_PARSE_HOLD_MAX; ++i) {
     if (HEDLEY_UNLIKELY(hold[i])) {
       upd_file_unref(hold[i]);
     }
   }
+  for (size_t i = 0; i < holds.n; ++i) {
+    upd_file_unref(holds.p[i]);
+  }
+  upd_array_clear(&holds);
+  upd_free(&mem);
+}
+
+
+static inline void upd_proto_parse_pool_put_(
+    upd_proto_parse_pool_t* pool, upd_proto_parse_t* par) {
+  size_t max = pool->max? pool->max: UPD_PROTO_PARSE_POOL_DEFAULT;
+  if (max > UPD_PROTO_PARSE_POOL_MAX) {
+    max = UPD_PROTO_PARSE_POOL_MAX;
+  }
+  --pool->inuse;
+  if (HEDLEY_LIKELY(pool->n < max)) {
+    pool->items[pool->n++] = par;
+  } else {
+    upd_free(&par);
+  }
+}
+
+
+static inline bool upd_proto_objpath_init(upd_proto_objpath_t* op) {
+  if (op->max == 0) {
+    op->max = UPD_PROTO_OBJPATH_DEFAULT;
+  }
+  op->entries = NULL;
+  if (HEDLEY_UNLIKELY(!upd_malloc(&op->entries, op->max*sizeof(*op->entries)))) {
+    return false;
+  }
+  for (size_t i = 0; i < op->max; ++i) {
+    op->entries[i].gen = 0;
+  }
+  op->gen    = 1;
+  op->hits   = 0;
+  op->misses = 0;
+  return true;
 }
 
+static inline void upd_proto_objpath_deinit(upd_proto_objpath_t* op) {
+  upd_free(&op->entries);
+}
+
+static inline void* upd_proto_objpath_find(
+    upd_proto_objpath_t* op, const msgpack_object_array* path) {
+  uint8_t      key[UPD_PROTO_OBJPATH_KEY_MAX];
+  const size_t len = upd_proto_objpath_key_(key, path);
+  if (HEDLEY_UNLIKELY(len == 0)) {
+    ++op->misses;
+    return op->resolve(op, path);
+  }
+
+  const uint32_t h = upd_str_hash(key, len);
+
+  upd_proto_objpath_entry_t* e = &op->entries[h % op->max];
+  if (HEDLEY_LIKELY(
+      e->gen  == op->gen &&
+      e->hash == h       &&
+      e->len  == len     &&
+      memcmp(e->key, key, len) == 0)) {
+    ++op->hits;
+    return e->handle;
+  }
+
+  ++op->misses;
+  void* handle = op->resolve(op, path);
+  if (HEDLEY_LIKELY(handle)) {
+    e->gen    = op->gen;
+    e->hash   = h;
+    e->len    = len;
+    e->handle = handle;
+    memcpy(e->key, key, len);
+  }
+  return handle;
+}
+
+static inline void upd_proto_objpath_invalidate(upd_proto_objpath_t* op) {
+  ++op->gen;
+}
+
+
+static inline void upd_proto_pipeline_parse_cb_(upd_proto_parse_t* par) {
+  upd_proto_pipeline_slot_t* slot = par->udata;
+
+  /* refs and memory held by par are kept until the result goes out */
+  slot->done = true;
+  upd_proto_pipeline_flush_(slot->pl);
+}
+
+static inline void upd_proto_pipeline_flush_(upd_proto_pipeline_t* pl) {
+  /* a callback completing another parse synchronously comes here again */
+  if (HEDLEY_UNLIKELY(pl->flushing)) {
+    return;
+  }
+  pl->flushing = true;
+
+  while (pl->n) {
+    upd_proto_pipeline_slot_t* slot = &pl->slots[pl->head];
+    if (!slot->done) {
+      break;
+    }
+
+    /* the slot stays in flight until the callback returns,
+     * so submission in the callback cannot reuse it */
+    pl->msg  = &slot->par.msg;
+    pl->err  = slot->par.err;
+    pl->item = slot->udata;
+    pl->cb(pl);
+
+    upd_proto_parse_release(&slot->par);
+    pl->head = (pl->head+1) % pl->depth;
+    --pl->n;
+  }
+  pl->msg  = NULL;
+  pl->err  = NULL;
+  pl->item = NULL;
+
+  pl->flushing = false;
+}
+
+
+static inline bool upd_proto_parse_tensor_(
+    upd_proto_parse_t* par, const msgpack_object_map* map) {
+  upd_proto_msg_t* msg = &par->msg;
+
+  const msgpack_object_str*   type = NULL;
+  const msgpack_object_array* reso = NULL;
+  const msgpack_object*       data = NULL;
+  const char* invalid =
+    upd_msgpack_find_fields(map, (upd_msgpack_field_t[]) {
+        { .name = "type", .required = true, .str   = &type, },
+        { .name = "reso", .required = true, .array = &reso, },
+        { .name = "data", .required = true, .any   = &data, },
+        { NULL, },
+      });
+  if (HEDLEY_UNLIKELY(invalid)) {
+    return false;
+  }
+
+  const upd_str_switch_case_t* t =
+    upd_strcase_switch((uint8_t*) type->ptr, type->size, (upd_str_switch_case_t[]) {
+        { .str = "u8",  .i = UPD_TENSOR_U8,  },
+        { .str = "u16", .i = UPD_TENSOR_U16, },
+        { .str = "f32", .i = UPD_TENSOR_F32, },
+        { .str = "f64", .i = UPD_TENSOR_F64, },
+        { NULL, },
+      });
+  if (HEDLEY_UNLIKELY(t == NULL)) {
+    return false;
+  }
+  if (HEDLEY_UNLIKELY(reso->size == 0 || reso->size > UPD_PROTO_TENSOR_RANK_MAX)) {
+    return false;
+  }
+  if (HEDLEY_UNLIKELY(data->type != MSGPACK_OBJECT_BIN)) {
+    return false;
+  }
+
+  if (HEDLEY_UNLIKELY(!upd_malloc(&par->mem, reso->size*sizeof(uint32_t)))) {
+    return false;
+  }
+  uint64_t  expect = upd_tensor_type_sizeof(t->i);
+  uint32_t* r      = par->mem;
+  for (size_t i = 0; i < reso->size; ++i) {
+    const msgpack_object* v = &reso->ptr[i];
+    if (HEDLEY_UNLIKELY(
+        v->type != MSGPACK_OBJECT_POSITIVE_INTEGER ||
+        v->via.u64 == 0 || v->via.u64 > UINT32_MAX)) {
+      return false;
+    }
+    r[i] = v->via.u64;
+    if (HEDLEY_UNLIKELY(expect > UINT64_MAX/r[i])) {
+      return false;
+    }
+    expect *= r[i];
+  }
+
+  upd_req_tensor_data_t* tensor = &msg->encoder_frame.tensor;
+  *tensor = (upd_req_tensor_data_t) {
+    .meta = {
+      .rank = reso->size,
+      .type = t->i,
+      .reso = r,
+    },
+    .ptr  = (uint8_t*) data->via.bin.ptr,
+    .size = data->via.bin.size,
+  };
+  return expect == tensor->size;
+}
+
+static inline void upd_proto_batch_parse_cb_(upd_proto_parse_t* par) {
+  upd_proto_batch_unref_(par->udata);
+}
+
+static inline void upd_proto_batch_unref_(upd_proto_batch_t* b) {
+  if (HEDLEY_LIKELY(--b->refcnt)) {
+    return;
+  }
+
+  if (b->strict && !b->err) {
+    for (size_t i = 0; i < b->n; ++i) {
+      if (HEDLEY_UNLIKELY(b->pars[i].err)) {
+        b->err = "strict batch has invalid command";
+        break;
+      }
+    }
+  }
+
+  upd_proto_parse_t* pars = b->pars;
+  const size_t       n    = b->n;
+
+  b->cb(b);  /* b may be freed */
+
+  for (size_t i = 0; i < n; ++i) {
+    upd_proto_parse_release(&pars[i]);
+  }
+  upd_free(&pars);
+}
+
+/* flattens path into bytes, returns zero if it cannot be cached */
+static inline size_t upd_proto_objpath_key_(
+    uint8_t* key, const msgpack_object_array* path) {
+  size_t len = 0;
+  for (size_t i = 0; i < path->size; ++i) {
+    const msgpack_object* seg = &path->ptr[i];
+    switch (seg->type) {
+    case MSGPACK_OBJECT_STR: {
+      const size_t n = seg->via.str.size;
+      if (HEDLEY_UNLIKELY(n > UINT8_MAX || len+2+n > UPD_PROTO_OBJPATH_KEY_MAX)) {
+        return 0;
+      }
+      key[len++] = 's';
+      key[len++] = n;
+      memcpy(key+len, seg->via.str.ptr, n);
+      len += n;
+    } break;
+
+    case MSGPACK_OBJECT_POSITIVE_INTEGER:
+    case MSGPACK_OBJECT_NEGATIVE_INTEGER:
+      if (HEDLEY_UNLIKELY(len+1+sizeof(uint64_t) > UPD_PROTO_OBJPATH_KEY_MAX)) {
+        return 0;
+      }
+      key[len++] = seg->type == MSGPACK_OBJECT_POSITIVE_INTEGER? 'u': 'i';
+      memcpy(key+len, &seg->via.u64, sizeof(uint64_t));
+      len += sizeof(uint64_t);
+      break;
+
+    default:
+      return 0;
+    }
+  }
+  /* an empty path has one byte not to be confused with uncacheable ones */
+  if (len == 0) {
+    key[len++] = 0;
+  }
+  return len;
+}
 
 static inline void upd_proto_encoder_frame_file_pathfind_cb_(
     upd_pathfind_t* pf) {
   upd_proto_parse_t* par = pf->udata;
-  upd_iso_t*         iso = pf->iso;
   upd_proto_msg_t*   msg = &par->msg;
 
   upd_file_t* target = pf->len? NULL: pf->base;
-  upd_iso_unstack(iso, pf);
 
   if (HEDLEY_UNLIKELY(target == NULL)) {
     par->err = "file not found";
     goto EXIT;
   }
   msg->encoder_frame.file = target;
-  upd_proto_parse_hold_(par, target);
+  if (HEDLEY_UNLIKELY(!upd_proto_parse_hold_(par, target))) {
+    par->err = "nomem";
+  }
+
+EXIT:
+  upd_proto_parse_unref_(par);
+}
+static inline void upd_proto_encoder_frames_pathfind_cb_(
+    upd_pathfind_many_t* pfm) {
+  upd_proto_parse_t* par = pfm->udata;
+  upd_proto_msg_t*   msg = &par->msg;
+
+  /* empty slots are paths, in order of items */
+  upd_file_t** files = msg->encoder_frames.files;
+  size_t       j     = 0;
+  for (size_t i = 0; i < msg->encoder_frames.n; ++i) {
+    if (files[i] == NULL) {
+      files[i] = pfm->items[j++].file;
+    }
+  }
+  assert(j == pfm->n);
+
+  for (size_t i = 0; i < msg->encoder_frames.n; ++i) {
+    if (HEDLEY_UNLIKELY(files[i] == NULL)) {
+      par->err = "file not found";
+      goto EXIT;
+    }
+  }
+  for (size_t i = 0; i < msg->encoder_frames.n; ++i) {
+    if (HEDLEY_UNLIKELY(!upd_proto_parse_hold_(par, files[i]))) {
+      par->err = "nomem";
+      goto EXIT;
+    }
+  }
 
 EXIT:
   upd_proto_parse_unref_(par);
@@ -270,32 +1137,45 @@ static inline void upd_proto_parse_encoder_(upd_proto_parse_t* par) {
       return;
     }
 
+    const msgpack_object*     file   = NULL;
     uintmax_t                 file_i = 0;
     const msgpack_object_str* file_s = NULL;
+    const msgpack_object_map* tensor = NULL;
     const char* invalid =
       upd_msgpack_find_fields(msg->param, (upd_msgpack_field_t[]) {
-          { .name = "file", .ui = &file_i, .str = &file_s, .required = true, },
+          { .name = "file",   .any = &file, .ui = &file_i, .str = &file_s, },
+          { .name = "tensor", .map = &tensor, },
           { NULL, },
         });
-    if (HEDLEY_UNLIKELY(invalid)) {
+    if (HEDLEY_UNLIKELY(invalid || !file == !tensor)) {
+      par->err = "invalid param";
+      return;
+    }
+    if (HEDLEY_UNLIKELY(file && !file_s && file->type != MSGPACK_OBJECT_POSITIVE_INTEGER)) {
       par->err = "invalid param";
       return;
     }
 
+    if (tensor) {
+      /* producers having pixels skip the file hop */
+      msg->encoder_frame.file = NULL;
+      if (HEDLEY_UNLIKELY(!upd_proto_parse_tensor_(par, tensor))) {
+        par->err = "invalid tensor";
+      }
+      return;
+    }
+
     if (file_s) {
+      /* the path lives in the msg zone as long as par */
+      par->pf = (upd_pathfind_t) {
+        .iso   = iso,
+        .path  = (uint8_t*) file_s->ptr,
+        .len   = file_s->size,
+        .udata = par,
+        .cb    = upd_proto_encoder_frame_file_pathfind_cb_,
+      };
       ++par->refcnt;
-      const bool ok = upd_pathfind_with_dup(&(upd_pathfind_t) {
-          .iso   = iso,
-          .path  = (uint8_t*) file_s->ptr,
-          .len   = file_s->size,
-          .udata = par,
-          .cb    = upd_proto_encoder_frame_file_pathfind_cb_,
-        });
-      if (HEDLEY_UNLIKELY(!ok)) {
-        --par->refcnt;
-        par->err = "subreq failure";
-        return;
-      }
+      upd_pathfind(&par->pf);
     } else {
       upd_file_t* target = upd_file_get(iso, file_i);
       if (HEDLEY_UNLIKELY(target == NULL)) {
@@ -303,7 +1183,92 @@ static inline void upd_proto_parse_encoder_(upd_proto_parse_t* par) {
         return;
       }
       msg->encoder_frame.file = target;
-      upd_proto_parse_hold_(par, target);
+      if (HEDLEY_UNLIKELY(!upd_proto_parse_hold_(par, target))) {
+        par->err = "nomem";
+        return;
+      }
+    }
+  } break;
+
+  case UPD_PROTO_ENCODER_FRAMES: {
+    if (HEDLEY_UNLIKELY(msg->param == NULL)) {
+      par->err = "invalid param";
+      return;
+    }
+
+    const msgpack_object_array* files = NULL;
+    const char* invalid =
+      upd_msgpack_find_fields(msg->param, (upd_msgpack_field_t[]) {
+          { .name = "files", .array = &files, .required = true, },
+          { NULL, },
+        });
+    if (HEDLEY_UNLIKELY(invalid)) {
+      par->err = "invalid param";
+      return;
+    }
+
+    size_t paths = 0;
+    for (size_t i = 0; i < files->size; ++i) {
+      switch (files->ptr[i].type) {
+      case MSGPACK_OBJECT_POSITIVE_INTEGER:
+        break;
+      case MSGPACK_OBJECT_STR:
+        ++paths;
+        break;
+      default:
+        par->err = "invalid param";
+        return;
+      }
+    }
+
+    upd_pathfind_many_t* pfm = NULL;
+    const size_t size =
+      sizeof(*pfm) +
+      paths*sizeof(upd_pathfind_many_item_t) +
+      files->size*sizeof(upd_file_t*);
+    if (HEDLEY_UNLIKELY(!upd_malloc(&par->mem, size))) {
+      par->err = "nomem";
+      return;
+    }
+    pfm = par->mem;
+
+    upd_pathfind_many_item_t* items = (upd_pathfind_many_item_t*) (pfm+1);
+
+    msg->encoder_frames.files = (upd_file_t**) (items+paths);
+    msg->encoder_frames.n     = files->size;
+
+    size_t j = 0;
+    for (size_t i = 0; i < files->size; ++i) {
+      const msgpack_object* f = &files->ptr[i];
+      if (f->type == MSGPACK_OBJECT_STR) {
+        items[j++] = (upd_pathfind_many_item_t) {
+          .path = (uint8_t*) f->via.str.ptr,
+          .len  = f->via.str.size,
+        };
+        msg->encoder_frames.files[i] = NULL;
+      } else {
+        upd_file_t* target = upd_file_get(iso, f->via.u64);
+        if (HEDLEY_UNLIKELY(target == NULL)) {
+          par->err = "file not found";
+          return;
+        }
+        msg->encoder_frames.files[i] = target;
+      }
+    }
+
+    /* all paths are resolved at once sharing their common prefixes */
+    *pfm = (upd_pathfind_many_t) {
+      .iso   = iso,
+      .items = items,
+      .n     = paths,
+      .udata = par,
+      .cb    = upd_proto_encoder_frames_pathfind_cb_,
+    };
+    ++par->refcnt;
+    if (HEDLEY_UNLIKELY(!upd_pathfind_many(pfm))) {
+      --par->refcnt;
+      par->err = "subreq failure";
+      return;
     }
   } break;
 
@@ -1,11 +1,27 @@
 #pragma once
 
+#include <math.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
 
+#include <hedley.h>
 #include <utf8.h>
 
+#include "memory.h"
+
+
+#define UPD_STR_HASH_INIT  UINT32_C(0x811C9DC5)  /* FNV-1a offset basis */
+#define UPD_STR_HASH_PRIME UINT32_C(0x01000193)
+
+/* 767 significant digits are enough to round any double correctly */
+#define UPD_STR_DOUBLE_DIGITS 768
+
+/* 16 significant hex digits hold the 53 bits and more, rest is sticky */
+#define UPD_STR_DOUBLE_HEX_DIGITS 17
+
 
 typedef struct upd_str_switch_case_t {
   const char* str;
@@ -16,6 +32,27 @@ typedef struct upd_str_switch_case_t {
   };
 } upd_str_switch_case_t;
 
+typedef struct upd_str_set_key_t {
+  const char* str;
+  uint32_t    hash;
+  uint32_t    len;
+} upd_str_set_key_t;
+
+/* Names hashed into an open addressing table growing with them, so that
+ * a name is found usually with one comparison. Names are not copied and
+ * must outlive it. */
+typedef struct upd_str_set_t {
+  /* filled by user */
+  bool caseless;  /* ASCII letters match regardless of their case */
+
+  /* used internally */
+  size_t n;
+  size_t cap;  /* size of table, a power of 2 */
+
+  upd_str_set_key_t* keys;   /* cap/2 entries, table follows in the block */
+  uint32_t*          table;  /* index+1 of keys, 0 is empty */
+} upd_str_set_t;
+
 
 static inline
 bool
@@ -48,6 +85,79 @@ upd_strcaseq_c(
   size_t      v2len);
 
 
+static inline
+uint32_t
+upd_str_hash(
+  const void* str,
+  size_t      len);
+
+
+/* Frees all memory. */
+HEDLEY_NON_NULL(1)
+static inline
+void
+upd_str_set_clear(
+  upd_str_set_t* set);
+
+/* Removes all names but keeps the memory. */
+HEDLEY_NON_NULL(1)
+static inline
+void
+upd_str_set_reset(
+  upd_str_set_t* set);
+
+/* Adds str as the next index. Returns false on allocation failure. */
+HEDLEY_NON_NULL(1, 2)
+HEDLEY_WARN_UNUSED_RESULT
+static inline
+bool
+upd_str_set_add(
+  upd_str_set_t* set,
+  const char*    str);
+
+/* Returns index of the name equal to str, or SIZE_MAX. */
+HEDLEY_NON_NULL(1)
+static inline
+size_t
+upd_str_set_find(
+  const upd_str_set_t* set,
+  const void*          str,
+  size_t               len);
+
+
+/* The whole string must be a number, otherwise returns false.
+ * Integers accept "0x" and "0" prefixes like strtoumax(str, &end, 0),
+ * and no function depends on the current locale. */
+HEDLEY_NON_NULL(3)
+HEDLEY_WARN_UNUSED_RESULT
+static inline
+bool
+upd_str_parse_uint(
+  const uint8_t* str,
+  size_t         len,
+  uintmax_t*     v);
+
+HEDLEY_NON_NULL(3)
+HEDLEY_WARN_UNUSED_RESULT
+static inline
+bool
+upd_str_parse_int(
+  const uint8_t* str,
+  size_t         len,
+  intmax_t*      v);
+
+/* Accepts also inf, infinity, nan, nan(chars) and hex floats like strtod(),
+ * and rounds correctly in any case. */
+HEDLEY_NON_NULL(3)
+HEDLEY_WARN_UNUSED_RESULT
+static inline
+bool
+upd_str_parse_double(
+  const uint8_t* str,
+  size_t         len,
+  double*        v);
+
+
 static inline
 const upd_str_switch_case_t*
 upd_str_switch(
@@ -84,6 +194,455 @@ static inline bool upd_strcaseq_c(
 }
 
 
+static inline uint32_t upd_str_hash(const void* str, size_t len) {
+  const uint8_t* s = str;
+
+  uint32_t h = UPD_STR_HASH_INIT;
+  for (size_t i = 0; i < len; ++i) {
+    h = (h ^ s[i]) * UPD_STR_HASH_PRIME;
+  }
+  return h;
+}
+
+
+static inline void upd_str_set_clear(upd_str_set_t* set) {
+  upd_free(&set->keys);
+  *set = (upd_str_set_t) { .caseless = set->caseless, };
+}
+
+static inline void upd_str_set_reset(upd_str_set_t* set) {
+  set->n = 0;
+  if (set->table) {
+    memset(set->table, 0, set->cap*sizeof(*set->table));
+  }
+}
+
+static inline uint32_t upd_str_set_hash_(
+    const upd_str_set_t* set, const void* str, size_t len) {
+  if (HEDLEY_LIKELY(!set->caseless)) {
+    return upd_str_hash(str, len);
+  }
+  const uint8_t* s = str;
+
+  uint32_t h = UPD_STR_HASH_INIT;
+  for (size_t i = 0; i < len; ++i) {
+    const uint8_t c = s[i];
+    h = (h ^ (c >= 'A' && c <= 'Z'? c-'A'+'a': c)) * UPD_STR_HASH_PRIME;
+  }
+  return h;
+}
+
+static inline void upd_str_set_insert_(upd_str_set_t* set, size_t x) {
+  const size_t mask = set->cap-1;
+
+  size_t i = set->keys[x].hash & mask;
+  while (set->table[i]) i = (i+1) & mask;
+  set->table[i] = x+1;
+}
+
+static inline bool upd_str_set_add(upd_str_set_t* set, const char* str) {
+  const size_t len = utf8size_lazy(str);
+  if (HEDLEY_UNLIKELY(len > UINT32_MAX || set->n >= UINT32_MAX)) {
+    return false;
+  }
+
+  /* keeps the table half empty at least */
+  if (HEDLEY_UNLIKELY((set->n+1)*2 > set->cap)) {
+    const size_t cap = set->cap? set->cap*2: 16;
+
+    upd_str_set_key_t* keys = NULL;
+    const size_t ksize = cap/2*sizeof(*keys);
+    if (HEDLEY_UNLIKELY(!upd_malloc(&keys, ksize + cap*sizeof(uint32_t)))) {
+      return false;
+    }
+    if (set->n) {
+      memcpy(keys, set->keys, set->n*sizeof(*keys));
+    }
+    upd_free(&set->keys);
+
+    set->keys  = keys;
+    set->table = (uint32_t*) ((uint8_t*) keys + ksize);
+    set->cap   = cap;
+    memset(set->table, 0, cap*sizeof(*set->table));
+    for (size_t i = 0; i < set->n; ++i) {
+      upd_str_set_insert_(set, i);
+    }
+  }
+
+  set->keys[set->n] = (upd_str_set_key_t) {
+    .str  = str,
+    .hash = upd_str_set_hash_(set, str, len),
+    .len  = len,
+  };
+  upd_str_set_insert_(set, set->n++);
+  return true;
+}
+
+static inline size_t upd_str_set_find(
+    const upd_str_set_t* set, const void* str, size_t len) {
+  if (HEDLEY_UNLIKELY(set->n == 0)) {
+    return SIZE_MAX;
+  }
+  const size_t   mask = set->cap-1;
+  const uint32_t hash = upd_str_set_hash_(set, str, len);
+
+  for (size_t i = hash & mask; set->table[i]; i = (i+1) & mask) {
+    const size_t x = set->table[i]-1;
+    if (HEDLEY_UNLIKELY(set->keys[x].hash != hash)) {
+      continue;
+    }
+    const upd_str_set_key_t* k = &set->keys[x];
+    const bool eq = set->caseless?
+      upd_strcaseq(k->str, k->len, str, len):
+      upd_streq(k->str, k->len, str, len);
+    if (HEDLEY_LIKELY(eq)) {
+      return x;
+    }
+  }
+  return SIZE_MAX;
+}
+
+
+static inline bool upd_str_isspace_(uint8_t c) {
+  return c == ' ' || (c >= '\t' && c <= '\r');
+}
+
+static inline size_t upd_str_skip_space_(const uint8_t* str, size_t len) {
+  size_t i = 0;
+  while (i < len && upd_str_isspace_(str[i])) ++i;
+  return i;
+}
+
+static inline size_t upd_str_parse_sign_(
+    const uint8_t* str, size_t len, bool* neg) {
+  *neg = false;
+  if (HEDLEY_UNLIKELY(len == 0)) {
+    return 0;
+  }
+  if (str[0] == '-') {
+    *neg = true;
+    return 1;
+  }
+  return str[0] == '+';
+}
+
+static inline int upd_str_digit_(uint8_t c) {
+  if (c >= '0' && c <= '9') return c - '0';
+  if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+  return 99;
+}
+
+/* parses unsigned digits with a base prefix, and returns false on overflow */
+static inline bool upd_str_parse_digits_(
+    const uint8_t* str, size_t len, uintmax_t* v) {
+  unsigned base = 10;
+  if (len >= 1 && str[0] == '0') {
+    if (len >= 2 && (str[1] == 'x' || str[1] == 'X')) {
+      base = 16;
+      str += 2;
+      len -= 2;
+    } else {
+      base = 8;
+    }
+  }
+  if (HEDLEY_UNLIKELY(len == 0)) {
+    return false;
+  }
+
+  uintmax_t x = 0;
+  for (size_t i = 0; i < len; ++i) {
+    const unsigned d = (unsigned) upd_str_digit_(str[i]);
+    if (HEDLEY_UNLIKELY(d >= base)) {
+      return false;
+    }
+    if (HEDLEY_UNLIKELY(x > (UINTMAX_MAX-d)/base)) {
+      return false;
+    }
+    x = x*base + d;
+  }
+  *v = x;
+  return true;
+}
+
+static inline bool upd_str_parse_uint(
+    const uint8_t* str, size_t len, uintmax_t* v) {
+  size_t i = upd_str_skip_space_(str, len);
+
+  bool neg;
+  i += upd_str_parse_sign_(str+i, len-i, &neg);
+  if (HEDLEY_UNLIKELY(neg)) {
+    return false;
+  }
+  return upd_str_parse_digits_(str+i, len-i, v);
+}
+
+static inline bool upd_str_parse_int(
+    const uint8_t* str, size_t len, intmax_t* v) {
+  size_t i = upd_str_skip_space_(str, len);
+
+  bool neg;
+  i += upd_str_parse_sign_(str+i, len-i, &neg);
+
+  uintmax_t x;
+  if (HEDLEY_UNLIKELY(!upd_str_parse_digits_(str+i, len-i, &x))) {
+    return false;
+  }
+
+  const uintmax_t max = (uintmax_t) INTMAX_MAX;
+  if (neg) {
+    if (HEDLEY_UNLIKELY(x > max+1)) {
+      return false;
+    }
+    *v = x > max? INTMAX_MIN: -(intmax_t) x;
+  } else {
+    if (HEDLEY_UNLIKELY(x > max)) {
+      return false;
+    }
+    *v = (intmax_t) x;
+  }
+  return true;
+}
+
+/* parses signed decimal exponent, and returns 0 if no digit found */
+static inline size_t upd_str_parse_exp_(
+    const uint8_t* str, size_t len, int64_t* e) {
+  bool   neg;
+  size_t i = upd_str_parse_sign_(str, len, &neg);
+
+  const size_t head = i;
+  *e = 0;
+  for (; i < len && str[i] >= '0' && str[i] <= '9'; ++i) {
+    if (*e < 100000) {  /* saturates far beyond the range of double */
+      *e = *e*10 + (str[i]-'0');
+    }
+  }
+  if (HEDLEY_UNLIKELY(i == head)) {
+    return 0;
+  }
+  if (neg) *e = -*e;
+  return i;
+}
+
+static inline char* upd_str_put_exp_(char* p, int64_t e) {
+  if (e < 0) {
+    *p++ = '-';
+    e    = -e;
+  }
+  char  buf[24];
+  char* q = buf;
+  do {
+    *q++ = (char) ('0' + e%10);
+    e   /= 10;
+  } while (e);
+  while (q > buf) *p++ = *--q;
+  return p;
+}
+
+/* Hex digits and binary exponent without any radix character are passed
+ * to strtod() regardless of the locale, as done with decimal ones. */
+static inline bool upd_str_parse_double_hex_(
+    const uint8_t* str, size_t len, bool neg, double* v) {
+  char  buf[UPD_STR_DOUBLE_HEX_DIGITS+32];
+  char* p = buf;
+  if (neg) *p++ = '-';
+  *p++ = '0';
+  *p++ = 'x';
+
+  size_t  i      = 0;
+  size_t  nm     = 0;  /* number of digits in mantissa */
+  size_t  n      = 0;  /* number of digits put */
+  int64_t e      = 0;
+  bool    dot    = false;
+  bool    sticky = false;
+  for (; i < len; ++i) {
+    const uint8_t c = str[i];
+    if (c == '.') {
+      if (HEDLEY_UNLIKELY(dot)) {
+        break;
+      }
+      dot = true;
+      continue;
+    }
+    const int d = upd_str_digit_(c);
+    if (d >= 16) {
+      break;
+    }
+    ++nm;
+    if (n == 0 && d == 0) {
+      e -= dot? 4: 0;
+    } else if (n < UPD_STR_DOUBLE_HEX_DIGITS) {
+      *p++ = (char) c;
+      ++n;
+      e -= dot? 4: 0;
+    } else {
+      e += dot? 0: 4;
+      sticky = sticky || d;
+    }
+  }
+  if (HEDLEY_UNLIKELY(nm == 0)) {
+    return false;
+  }
+  if (i < len && (str[i] == 'p' || str[i] == 'P')) {
+    int64_t pe;
+    const size_t used = upd_str_parse_exp_(str+i+1, len-i-1, &pe);
+    if (HEDLEY_UNLIKELY(used == 0)) {
+      return false;
+    }
+    i += 1 + used;
+    e += pe;
+  }
+  if (HEDLEY_UNLIKELY(i != len)) {
+    return false;
+  }
+  if (n == 0) {
+    *v = neg? -0.: 0.;
+    return true;
+  }
+  if (sticky) {
+    /* keeps the truncated tail non-zero for the rounding */
+    *p++ = '1';
+    e   -= 4;
+  }
+  *p++ = 'p';
+  p    = upd_str_put_exp_(p, e);
+  *p   = 0;
+
+  *v = strtod(buf, NULL);
+  return true;
+}
+
+static inline bool upd_str_parse_double(
+    const uint8_t* str, size_t len, double* v) {
+  static const double pow10[] = {
+    1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+  };
+
+  size_t i = upd_str_skip_space_(str, len);
+
+  bool neg;
+  i += upd_str_parse_sign_(str+i, len-i, &neg);
+
+  /* special values and hex floats like strtod() */
+  const uint8_t* rest = str+i;
+  const size_t   rlen = len-i;
+  if (upd_strcaseq_c("inf", rest, rlen) || upd_strcaseq_c("infinity", rest, rlen)) {
+    *v = neg? -INFINITY: INFINITY;
+    return true;
+  }
+  if (rlen >= 3 && upd_strcaseq_c("nan", rest, 3)) {
+    if (rlen > 3) {
+      if (HEDLEY_UNLIKELY(rest[3] != '(' || rest[rlen-1] != ')')) {
+        return false;
+      }
+      for (size_t j = 4; j < rlen-1; ++j) {
+        const uint8_t c = rest[j];
+        if (HEDLEY_UNLIKELY(upd_str_digit_(c) == 99 && c != '_' &&
+            !(c >= 'g' && c <= 'z') && !(c >= 'G' && c <= 'Z'))) {
+          return false;
+        }
+      }
+    }
+    *v = neg? -NAN: NAN;
+    return true;
+  }
+  if (rlen >= 2 && rest[0] == '0' && (rest[1] == 'x' || rest[1] == 'X')) {
+    return upd_str_parse_double_hex_(rest+2, rlen-2, neg, v);
+  }
+
+  const size_t head = i;
+
+  uint64_t w    = 0;  /* first 19 significant digits */
+  size_t   nd   = 0;  /* number of significant digits */
+  size_t   nm   = 0;  /* number of digits in mantissa */
+  int64_t  frac = 0;  /* number of digits after the point */
+  bool     dot  = false;
+  for (; i < len; ++i) {
+    const uint8_t c = str[i];
+    if (c == '.') {
+      if (HEDLEY_UNLIKELY(dot)) {
+        break;
+      }
+      dot = true;
+      continue;
+    }
+    if (c < '0' || c > '9') {
+      break;
+    }
+    ++nm;
+    frac += dot;
+    if (nd || c != '0') {
+      if (nd < 19) {
+        w = w*10 + (uint64_t) (c-'0');
+      }
+      ++nd;
+    }
+  }
+  if (HEDLEY_UNLIKELY(nm == 0)) {
+    return false;
+  }
+
+  int64_t e = 0;
+  if (i < len && (str[i] == 'e' || str[i] == 'E')) {
+    const size_t used = upd_str_parse_exp_(str+i+1, len-i-1, &e);
+    if (HEDLEY_UNLIKELY(used == 0)) {
+      return false;
+    }
+    i += 1 + used;
+  }
+  if (HEDLEY_UNLIKELY(i != len)) {
+    return false;
+  }
+  e -= frac;
+
+  /* Clinger's fast path: both are exact so the result is rounded once */
+  if (nd <= 19 && w <= (UINT64_C(1) << 53) && e >= -22 && e <= 22) {
+    double d = (double) w;
+    d = e < 0? d/pow10[-e]: d*pow10[e];
+    *v = neg? -d: d;
+    return true;
+  }
+  if (nd == 0) {
+    *v = neg? -0.: 0.;
+    return true;
+  }
+
+  /* Digits and exponent without any radix character can be passed to strtod()
+   * regardless of the locale. */
+  char  buf[UPD_STR_DOUBLE_DIGITS+32];
+  char* p = buf;
+  if (neg) *p++ = '-';
+
+  size_t n = 0;
+  bool   sticky = false;
+  for (size_t j = head; j < len; ++j) {
+    const uint8_t c = str[j];
+    if (c == '.') continue;
+    if (c < '0' || c > '9') break;
+    if (n == 0 && c == '0') continue;
+    if (n < UPD_STR_DOUBLE_DIGITS) {
+      *p++ = (char) c;
+      ++n;
+    } else if (c != '0') {
+      sticky = true;
+    }
+  }
+  e += (int64_t) (nd - n);
+  if (sticky) {
+    /* keeps the truncated tail non-zero for the rounding */
+    *p++ = '1';
+    --e;
+  }
+
+  *p++ = 'e';
+  p    = upd_str_put_exp_(p, e);
+  *p   = 0;
+
+  *v = strtod(buf, NULL);
+  return true;
+}
+
 static inline const upd_str_switch_case_t* upd_str_switch(
     const uint8_t* str, size_t len, const upd_str_switch_case_t cases[]) {
   while (cases->str) {
@@ -1,20 +1,26 @@
 #pragma once
 
 #include <assert.h>
-#include <inttypes.h>
 #include <math.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include <hedley.h>
 #include <utf8.h>
 #include <yaml.h>
 
+#include "libupd/buf.h"
 #include "libupd/str.h"
 
 
+/* values of more fields are collected in heap */
+#define UPD_YAML_FIELDSET_MAX 32
+#define UPD_YAML_STREAM_DEPTH 8
+
+
 typedef struct upd_yaml_field_t {
   const char* name;
   bool        required;
@@ -28,8 +34,43 @@ typedef struct upd_yaml_field_t {
   const yaml_node_t** seq;
   const yaml_node_t** map;
   const yaml_node_t** any;
+
+  /* a copy of scalar is appended */
+  upd_buf_t* buf;
+
+  /* fields of the nested mapping */
+  const struct upd_yaml_field_t* fields;
 } upd_yaml_field_t;
 
+/* Fields passed with it must have the same names in the same order,
+ * and names are freed in the same way as upd_msgpack_fieldset_t. */
+typedef struct upd_yaml_fieldset_t {
+  bool          compiled;
+  upd_str_set_t names;
+} upd_yaml_fieldset_t;
+
+typedef struct upd_yaml_stream_frame_t {
+  upd_str_set_t           names;
+  const upd_yaml_field_t* fields;
+  const upd_yaml_field_t* field;
+
+  bool*  seen;  /* flag for each field */
+  size_t seenmax;
+  bool   value;
+} upd_yaml_stream_frame_t;
+
+/* used internally by upd_yaml_stream_fields() */
+typedef struct upd_yaml_stream_t {
+  const upd_yaml_field_t* fields;
+  const char*             invalid;
+
+  size_t depth;
+  size_t skip;
+  bool   done;
+
+  upd_yaml_stream_frame_t stack[UPD_YAML_STREAM_DEPTH];
+} upd_yaml_stream_t;
+
 
 HEDLEY_NON_NULL(1)
 HEDLEY_WARN_UNUSED_RESULT
@@ -51,6 +92,10 @@ upd_yaml_find_node_by_name(
   size_t             len);
 
 
+/* Returns name of the innermost field which is missing or cannot take its
+ * value, or NULL.
+ * Compiles a fieldset in heap at every call, so hot callers should keep
+ * one with upd_yaml_find_fields_compiled(). */
 HEDLEY_NON_NULL(1, 2, 3)
 HEDLEY_WARN_UNUSED_RESULT
 static inline
@@ -67,6 +112,75 @@ upd_yaml_find_fields_from_root(
   yaml_document_t*        doc,
   const upd_yaml_field_t* fields);
 
+HEDLEY_NON_NULL(1, 2)
+HEDLEY_WARN_UNUSED_RESULT
+static inline
+bool
+upd_yaml_fieldset_compile(
+  upd_yaml_fieldset_t*    fs,
+  const upd_yaml_field_t* fields);
+
+/* Walks the mapping only once, and dispatches each key by its hash.
+ * Falls back to looking up each field if fs cannot be compiled. */
+HEDLEY_NON_NULL(1, 2, 3, 4)
+HEDLEY_WARN_UNUSED_RESULT
+static inline
+const char*
+upd_yaml_find_fields_compiled(
+  yaml_document_t*        doc,
+  const yaml_node_t*      node,
+  upd_yaml_fieldset_t*    fs,
+  const upd_yaml_field_t* fields);
+
+/* Binds values into the fields while parsing, without building any document.
+ * Only scalar targets (b, ui, i, f, and buf) and nested fields are available
+ * because no node lives longer than its event.
+ * The name of an invalid field is set to *invalid as upd_yaml_find_fields()
+ * returns, and *invalid is NULL on syntax error or allocation failure. */
+HEDLEY_NON_NULL(1, 3)
+HEDLEY_WARN_UNUSED_RESULT
+static inline
+bool
+upd_yaml_stream_fields(
+  const uint8_t*          str,
+  size_t                  len,
+  const upd_yaml_field_t* fields,
+  const char**            invalid);
+
+
+/* returns name of the innermost field which cannot take its value, or NULL */
+static inline
+const char*
+upd_yaml_field_assign_(
+  yaml_document_t*        doc,
+  const upd_yaml_field_t* f,
+  const yaml_node_t*      item);
+
+static inline
+const char*
+upd_yaml_find_fields_linear_(
+  yaml_document_t*        doc,
+  const yaml_node_t*      node,
+  const upd_yaml_field_t* f);
+
+static inline
+bool
+upd_yaml_field_assign_scalar_(
+  const upd_yaml_field_t* f,
+  const uint8_t*          s,
+  size_t                  n);
+
+static inline
+void
+upd_yaml_stream_clear_(
+  upd_yaml_stream_t* st);
+
+static inline
+bool
+upd_yaml_stream_event_(
+  upd_yaml_stream_t*  st,
+  const yaml_event_t* e);
+
 
 static inline bool upd_yaml_parse(
     yaml_document_t* doc, const uint8_t* str, size_t len) {
@@ -118,6 +232,20 @@ static inline const char* upd_yaml_find_fields(
     yaml_document_t*        doc,
     const yaml_node_t*      node,
     const upd_yaml_field_t* f) {
+  upd_yaml_fieldset_t fs = {0};
+  if (HEDLEY_LIKELY(upd_yaml_fieldset_compile(&fs, f))) {
+    const char* ret = upd_yaml_find_fields_compiled(doc, node, &fs, f);
+    upd_str_set_clear(&fs.names);
+    return ret;
+  }
+  upd_str_set_clear(&fs.names);
+  return upd_yaml_find_fields_linear_(doc, node, f);
+}
+
+static inline const char* upd_yaml_find_fields_linear_(
+    yaml_document_t*        doc,
+    const yaml_node_t*      node,
+    const upd_yaml_field_t* f) {
   for (; f->name; ++f) {
     const yaml_node_t* item = upd_yaml_find_node_by_name(
       doc, node, (uint8_t*) f->name, utf8size_lazy(f->name));
@@ -127,101 +255,437 @@ static inline const char* upd_yaml_find_fields(
       }
       continue;
     }
+    const char* invalid = upd_yaml_field_assign_(doc, f, item);
+    if (HEDLEY_UNLIKELY(invalid)) {
+      return invalid;
+    }
+  }
+  return NULL;
+}
 
-    bool used = false;
-    if (f->any) {
-      *f->any = item;
-      used    = true;
+static inline const char* upd_yaml_find_fields_from_root(
+    yaml_document_t* doc, const upd_yaml_field_t* fields) {
+  const yaml_node_t* root = yaml_document_get_root_node(doc);
+  if (HEDLEY_UNLIKELY(root == NULL)) {
+    return false;
+  }
+  return upd_yaml_find_fields(doc, root, fields);
+}
+
+static inline bool upd_yaml_fieldset_compile(
+    upd_yaml_fieldset_t* fs, const upd_yaml_field_t* f) {
+  upd_str_set_clear(&fs->names);
+  for (; f->name; ++f) {
+    if (HEDLEY_UNLIKELY(!upd_str_set_add(&fs->names, f->name))) {
+      return false;
     }
+  }
+  fs->compiled = true;
+  return true;
+}
 
-    switch (item->type) {
-    case YAML_SCALAR_NODE:
-      if (f->str) {
-        *f->str = item;
-        used    = true;
-      }
-      const uint8_t* s = item->data.scalar.value;
-      const size_t   n = item->data.scalar.length;
-
-      if (f->b) {
-        const bool yes =
-          upd_strcaseq_c("true", s, n) ||
-          upd_strcaseq_c("yes",  s, n) ||
-          upd_strcaseq_c("y",    s, n) ||
-          upd_strcaseq_c("on",   s, n);
-        const bool no =
-          upd_strcaseq_c("false", s, n) ||
-          upd_strcaseq_c("no",    s, n) ||
-          upd_strcaseq_c("n",     s, n) ||
-          upd_strcaseq_c("off",   s, n);
-        if (yes != no) {
-          *f->b = yes;
-          used  = true;
-        }
-      }
+static inline const char* upd_yaml_find_fields_compiled(
+    yaml_document_t*        doc,
+    const yaml_node_t*      node,
+    upd_yaml_fieldset_t*    fs,
+    const upd_yaml_field_t* f) {
+  if (HEDLEY_UNLIKELY(!fs->compiled)) {
+    if (HEDLEY_UNLIKELY(!upd_yaml_fieldset_compile(fs, f))) {
+      return upd_yaml_find_fields_linear_(doc, node, f);
+    }
+  }
+  const size_t n = fs->names.n;
+
+  const yaml_node_t*  inline_v[UPD_YAML_FIELDSET_MAX] = {0};
+  const yaml_node_t** v = inline_v;
+  if (HEDLEY_UNLIKELY(n > UPD_YAML_FIELDSET_MAX)) {
+    v = NULL;
+    if (HEDLEY_UNLIKELY(!upd_malloc(&v, n*sizeof(*v)))) {
+      return upd_yaml_find_fields_linear_(doc, node, f);
+    }
+    memset(v, 0, n*sizeof(*v));
+  }
 
-      char temp[32];
-      temp[0] = 0;
-      if (f->ui || f->i || f->f) {
-        if (n < sizeof(temp)) {
-          utf8ncpy(temp, s, n);
-          temp[n] = 0;
-        }
+  const char* ret = NULL;
+  if (HEDLEY_LIKELY(node->type == YAML_MAPPING_NODE)) {
+    const yaml_node_pair_t* itr = node->data.mapping.pairs.start;
+    const yaml_node_pair_t* end = node->data.mapping.pairs.top;
+    for (; itr < end; ++itr) {
+      const yaml_node_t* k = yaml_document_get_node(doc, itr->key);
+      if (HEDLEY_UNLIKELY(k == NULL || k->type != YAML_SCALAR_NODE)) {
+        continue;
       }
+      const size_t x = upd_str_set_find(
+        &fs->names, k->data.scalar.value, k->data.scalar.length);
 
-      char* end;
-      if (temp[0] && f->ui) {
-        const uintmax_t v = strtoumax(temp, &end, 0);
-        if (!*end && v != UINTMAX_MAX) {
-          *f->ui = v;
-          used   = true;
-        }
+      /* the first one wins like upd_yaml_find_node_by_name() */
+      if (HEDLEY_LIKELY(x != SIZE_MAX && v[x] == NULL)) {
+        v[x] = yaml_document_get_node(doc, itr->value);
       }
-      if (temp[0] && f->i) {
-        const intmax_t v = strtoimax(temp, &end, 0);
-        if (!*end && v != INTMAX_MIN && v != INTMAX_MAX) {
-          *f->i = v;
-          used  = true;
-        }
-      }
-      if (temp[0] && f->f) {
-        const double v = strtod(temp, &end);
-        if (!*end && isfinite(v)) {
-          *f->f = v;
-          used  = true;
-        }
+    }
+  }
+
+  for (size_t i = 0; i < n; ++i) {
+    if (HEDLEY_UNLIKELY(v[i] == NULL)) {
+      if (HEDLEY_UNLIKELY(f[i].required)) {
+        ret = f[i].name;
+        goto EXIT;
       }
-      break;
+      continue;
+    }
+    ret = upd_yaml_field_assign_(doc, &f[i], v[i]);
+    if (HEDLEY_UNLIKELY(ret)) {
+      goto EXIT;
+    }
+  }
+
+EXIT:
+  if (HEDLEY_UNLIKELY(v != inline_v)) {
+    upd_free(&v);
+  }
+  return ret;
+}
+
+
+static inline bool upd_yaml_stream_fields(
+    const uint8_t*          str,
+    size_t                  len,
+    const upd_yaml_field_t* fields,
+    const char**            invalid) {
+  if (invalid) {
+    *invalid = NULL;
+  }
+  if (HEDLEY_UNLIKELY(len == 0)) {
+    return false;
+  }
+
+  yaml_parser_t parser = {0};
+  if (HEDLEY_UNLIKELY(!yaml_parser_initialize(&parser))) {
+    return false;
+  }
+  yaml_parser_set_input_string(&parser, str, len);
+
+  upd_yaml_stream_t st = { .fields = fields, };
+  while (!st.done) {
+    yaml_event_t e;
+    if (HEDLEY_UNLIKELY(!yaml_parser_parse(&parser, &e))) {
+      goto ABORT;
+    }
+    const bool ok = upd_yaml_stream_event_(&st, &e);
+    yaml_event_delete(&e);
+    if (HEDLEY_UNLIKELY(!ok)) {
+      goto ABORT;
+    }
+  }
+  upd_yaml_stream_clear_(&st);
+  yaml_parser_delete(&parser);
+  return true;
+
+ABORT:
+  if (invalid) {
+    *invalid = st.invalid;
+  }
+  upd_yaml_stream_clear_(&st);
+  yaml_parser_delete(&parser);
+  return false;
+}
+
+
+static inline const char* upd_yaml_field_assign_(
+    yaml_document_t*        doc,
+    const upd_yaml_field_t* f,
+    const yaml_node_t*      item) {
+  bool used = false;
+  if (f->any) {
+    *f->any = item;
+    used    = true;
+  }
+
+  switch (item->type) {
+  case YAML_SCALAR_NODE:
+    if (f->str) {
+      *f->str = item;
+      used    = true;
+    }
+    if (upd_yaml_field_assign_scalar_(
+        f, item->data.scalar.value, item->data.scalar.length)) {
+      used = true;
+    }
+    break;
 
-    case YAML_SEQUENCE_NODE:
-      if (f->seq) {
-        *f->seq = item;
-        used    = true;
+  case YAML_SEQUENCE_NODE:
+    if (f->seq) {
+      *f->seq = item;
+      used    = true;
+    }
+    break;
+
+  case YAML_MAPPING_NODE:
+    if (f->map) {
+      *f->map = item;
+      used    = true;
+    }
+    if (f->fields) {
+      const char* invalid = upd_yaml_find_fields(doc, item, f->fields);
+      if (HEDLEY_UNLIKELY(invalid)) {
+        return invalid;
       }
-      break;
+      used = true;
+    }
+    break;
+
+  default:
+    break;
+  }
+  return used? NULL: f->name;
+}
+
+static inline bool upd_yaml_field_assign_scalar_(
+    const upd_yaml_field_t* f, const uint8_t* s, size_t n) {
+  bool used = false;
+  if (f->b) {
+    const bool yes =
+      upd_strcaseq_c("true", s, n) ||
+      upd_strcaseq_c("yes",  s, n) ||
+      upd_strcaseq_c("y",    s, n) ||
+      upd_strcaseq_c("on",   s, n);
+    const bool no =
+      upd_strcaseq_c("false", s, n) ||
+      upd_strcaseq_c("no",    s, n) ||
+      upd_strcaseq_c("n",     s, n) ||
+      upd_strcaseq_c("off",   s, n);
+    if (yes != no) {
+      *f->b = yes;
+      used  = true;
+    }
+  }
+
+  if (f->ui) {
+    uintmax_t v;
+    if (upd_str_parse_uint(s, n, &v)) {
+      *f->ui = v;
+      used   = true;
+    }
+  }
+  if (f->i) {
+    intmax_t v;
+    if (upd_str_parse_int(s, n, &v)) {
+      *f->i = v;
+      used  = true;
+    }
+  }
+  if (f->f) {
+    double v;
+    if (upd_str_parse_double(s, n, &v) && isfinite(v)) {
+      *f->f = v;
+      used  = true;
+    }
+  }
+
+  if (f->buf) {
+    if (HEDLEY_LIKELY(upd_buf_append(f->buf, s, n) || n == 0)) {
+      used = true;
+    }
+  }
+  return used;
+}
+
+
+static inline const char* upd_yaml_stream_missing_(
+    const upd_yaml_field_t* f, const bool* seen) {
+  for (size_t i = 0; f[i].name; ++i) {
+    const bool found = seen && seen[i];
+    if (HEDLEY_UNLIKELY(f[i].required && !found)) {
+      return f[i].name;
+    }
+  }
+  return NULL;
+}
+
+static inline void upd_yaml_stream_clear_(upd_yaml_stream_t* st) {
+  for (size_t i = 0; i < UPD_YAML_STREAM_DEPTH; ++i) {
+    upd_str_set_clear(&st->stack[i].names);
+    upd_free(&st->stack[i].seen);
+  }
+}
+
+static inline bool upd_yaml_stream_push_(
+    upd_yaml_stream_t* st, const upd_yaml_field_t* fields, const char* name) {
+  if (HEDLEY_UNLIKELY(st->depth >= UPD_YAML_STREAM_DEPTH)) {
+    st->invalid = name;
+    return false;
+  }
+  upd_yaml_stream_frame_t* fr = &st->stack[st->depth];
+  upd_str_set_reset(&fr->names);
+  for (const upd_yaml_field_t* f = fields; f->name; ++f) {
+    if (HEDLEY_UNLIKELY(!upd_str_set_add(&fr->names, f->name))) {
+      return false;
+    }
+  }
+
+  /* memory of the frame is kept for the next mapping in the same depth */
+  const size_t n = fr->names.n;
+  if (HEDLEY_UNLIKELY(n > fr->seenmax)) {
+    if (HEDLEY_UNLIKELY(!upd_malloc(&fr->seen, n*sizeof(*fr->seen)))) {
+      return false;
+    }
+    fr->seenmax = n;
+  }
+  if (HEDLEY_LIKELY(n)) {
+    memset(fr->seen, 0, n*sizeof(*fr->seen));
+  }
+  fr->fields = fields;
+  fr->field  = NULL;
+  fr->value  = false;
+  ++st->depth;
+  return true;
+}
+
+static inline bool upd_yaml_stream_pop_(upd_yaml_stream_t* st) {
+  upd_yaml_stream_frame_t* fr = &st->stack[st->depth-1];
+
+  const char* missing = upd_yaml_stream_missing_(fr->fields, fr->seen);
+  if (HEDLEY_UNLIKELY(missing)) {
+    st->invalid = missing;
+    return false;
+  }
+  if (--st->depth == 0) {
+    st->done = true;
+  } else {
+    st->stack[st->depth-1].value = false;
+  }
+  return true;
+}
+
+/* called after a key or value is consumed */
+static inline void upd_yaml_stream_next_(upd_yaml_stream_t* st) {
+  upd_yaml_stream_frame_t* fr = &st->stack[st->depth-1];
+  if (fr->value) {
+    fr->value = false;
+  } else {
+    fr->field = NULL;
+    fr->value = true;
+  }
+}
+
+static inline const upd_yaml_field_t* upd_yaml_stream_lookup_(
+    upd_yaml_stream_t* st, const uint8_t* s, size_t n) {
+  upd_yaml_stream_frame_t* fr = &st->stack[st->depth-1];
+
+  const size_t x = upd_str_set_find(&fr->names, s, n);
 
-    case YAML_MAPPING_NODE:
-      if (f->map) {
-        *f->map = item;
-        used    = true;
+  /* the first one wins like upd_yaml_find_node_by_name() */
+  if (HEDLEY_UNLIKELY(x == SIZE_MAX || fr->seen[x])) {
+    return NULL;
+  }
+  fr->seen[x] = true;
+  return &fr->fields[x];
+}
+
+static inline bool upd_yaml_stream_event_(
+    upd_yaml_stream_t* st, const yaml_event_t* e) {
+  if (st->skip) {
+    switch (e->type) {
+    case YAML_SEQUENCE_START_EVENT:
+    case YAML_MAPPING_START_EVENT:
+      ++st->skip;
+      break;
+    case YAML_SEQUENCE_END_EVENT:
+    case YAML_MAPPING_END_EVENT:
+      if (--st->skip == 0) {
+        upd_yaml_stream_next_(st);
       }
       break;
-
     default:
       break;
     }
-    if (HEDLEY_UNLIKELY(!used)) {
-      return f->name;
+    return true;
+  }
+
+  if (st->depth == 0) {
+    switch (e->type) {
+    case YAML_MAPPING_START_EVENT:
+      return upd_yaml_stream_push_(st, st->fields, NULL);
+
+    case YAML_SCALAR_EVENT:
+    case YAML_SEQUENCE_START_EVENT:
+    case YAML_ALIAS_EVENT:
+    case YAML_DOCUMENT_END_EVENT:
+    case YAML_STREAM_END_EVENT:
+      /* root is not a mapping so nothing can be found */
+      st->done    = true;
+      st->invalid = upd_yaml_stream_missing_(st->fields, NULL);
+      return !st->invalid;
+
+    default:
+      return true;
     }
   }
-  return NULL;
-}
 
-static inline const char* upd_yaml_find_fields_from_root(
-    yaml_document_t* doc, const upd_yaml_field_t* fields) {
-  const yaml_node_t* root = yaml_document_get_root_node(doc);
-  if (HEDLEY_UNLIKELY(root == NULL)) {
+  upd_yaml_stream_frame_t* fr = &st->stack[st->depth-1];
+  if (!fr->value) {
+    switch (e->type) {
+    case YAML_SCALAR_EVENT:
+      fr->field = upd_yaml_stream_lookup_(
+        st, e->data.scalar.value, e->data.scalar.length);
+      fr->value = true;
+      return true;
+
+    case YAML_ALIAS_EVENT:
+      fr->field = NULL;
+      fr->value = true;
+      return true;
+
+    case YAML_SEQUENCE_START_EVENT:
+    case YAML_MAPPING_START_EVENT:
+      /* complex key is ignored with its value */
+      st->skip = 1;
+      return true;
+
+    case YAML_MAPPING_END_EVENT:
+      return upd_yaml_stream_pop_(st);
+
+    default:
+      return true;
+    }
+  }
+
+  const upd_yaml_field_t* f = fr->field;
+  switch (e->type) {
+  case YAML_SCALAR_EVENT:
+    if (f) {
+      const bool used = upd_yaml_field_assign_scalar_(
+        f, e->data.scalar.value, e->data.scalar.length);
+      if (HEDLEY_UNLIKELY(!used)) {
+        st->invalid = f->name;
+        return false;
+      }
+    }
+    fr->value = false;
+    return true;
+
+  case YAML_MAPPING_START_EVENT:
+    if (f && f->fields) {
+      return upd_yaml_stream_push_(st, f->fields, f->name);
+    }
+    break;
+
+  case YAML_SEQUENCE_START_EVENT:
+  case YAML_ALIAS_EVENT:
+    break;
+
+  default:
+    return true;
+  }
+
+  if (HEDLEY_UNLIKELY(f)) {
+    st->invalid = f->name;
     return false;
   }
-  return upd_yaml_find_fields(doc, root, fields);
+  if (e->type == YAML_ALIAS_EVENT) {
+    fr->value = false;
+  } else {
+    st->skip = 1;
+  }
+  return true;
 }
@@ -24,7 +24,135 @@
 #include "libupd/yaml.h"
 
 
-upd_external_t upd = {0};  /* just to avoid linker error */
+upd_external_t upd = {0};  /* host is replaced by test_host_ in main() */
+
+/* a minimal host with an in-memory dir driver, just enough for pathfind */
+static
+void*
+test_host_stack_(
+  upd_iso_t* iso,
+  uint64_t   len);
+
+static
+void
+test_host_unstack_(
+  upd_iso_t* iso,
+  void*      ptr);
+
+static
+uint64_t
+test_host_now_(
+  upd_iso_t* iso);
+
+static
+upd_file_t*
+test_host_file_get_(
+  upd_iso_t*    iso,
+  upd_file_id_t id);
+
+static
+void
+test_host_file_ref_(
+  upd_file_t* f);
+
+static
+bool
+test_host_file_unref_(
+  upd_file_t* f);
+
+static
+bool
+test_host_file_watch_(
+  upd_file_watch_t* w);
+
+static
+void
+test_host_file_unwatch_(
+  upd_file_watch_t* w);
+
+static
+void
+test_host_file_trigger_(
+  upd_file_t*      f,
+  upd_file_event_t e);
+
+static
+bool
+test_host_file_lock_(
+  upd_file_lock_t* k);
+
+static
+void
+test_host_file_unlock_(
+  upd_file_lock_t* k);
+
+static
+upd_file_t*
+test_host_dir_new_(
+  upd_file_t*    parent,
+  const uint8_t* name,
+  size_t         len);
+
+static
+void
+test_host_lock_complete_(
+  size_t i);
+
+static
+void
+test_host_clear_(
+  void);
+
+static
+bool
+test_host_dir_handle_(
+  upd_req_t* req);
+
+static const upd_host_t test_host_ = {
+  .ver = UPD_VER,
+  .iso = {
+    .stack   = test_host_stack_,
+    .unstack = test_host_unstack_,
+    .now     = test_host_now_,
+  },
+  .file = {
+    .get     = test_host_file_get_,
+    .ref     = test_host_file_ref_,
+    .unref   = test_host_file_unref_,
+    .watch   = test_host_file_watch_,
+    .unwatch = test_host_file_unwatch_,
+    .trigger = test_host_file_trigger_,
+    .lock    = test_host_file_lock_,
+    .unlock  = test_host_file_unlock_,
+  },
+};
+
+static const upd_driver_t test_host_dir_ = {
+  .name   = (uint8_t*) "test.dir",
+  .handle = test_host_dir_handle_,
+};
+
+#define test_iso_ ((upd_iso_t*) &test_host_)
+
+static upd_array_of(upd_file_t*)       test_host_files_;
+static upd_array_of(upd_file_watch_t*) test_host_watches_;
+
+/* locks are completed by test_host_lock_complete_() while defer is set */
+static bool                           test_host_lock_defer_;
+static upd_array_of(upd_file_lock_t*) test_host_locks_;
+
+/* the last name received by UPD_REQ_DIR_NEWPATH, rejected if not accepted */
+static bool    test_host_newpath_accept_;
+static uint8_t test_host_newpath_[64];
+static size_t  test_host_newpath_len_;
+
+/* order of write completions and mpk->cb calls */
+static upd_buf_t test_msgpack_log_;
+
+/* objects processed by test_msgpack_sync_cb_() and its nesting */
+static size_t test_msgpack_sync_n_;
+static size_t test_msgpack_sync_depth_;
+static size_t test_msgpack_sync_maxdepth_;
 
 static
 void
@@ -41,11 +169,100 @@ void
 test_memory_(
   void);
 
+static
+void
+test_msgpack_(
+  void);
+
+static
+int
+test_msgpack_write_cb_(
+  void*       data,
+  const char* buf,
+  size_t      len);
+
+static
+void
+test_msgpack_cb_(
+  upd_msgpack_t* mpk);
+
+static
+void
+test_msgpack_sync_cb_(
+  upd_msgpack_t* mpk);
+
+static
+void
+test_msgpack_reserve_cb_(
+  upd_req_t* req);
+
+static
+void
+test_msgpack_write_done_cb_(
+  upd_req_t* req);
+
+static
+bool
+test_msgpack_visitor_cb_(
+  upd_msgpack_visitor_t*     v,
+  const upd_msgpack_event_t* e);
+
 static
 void
 test_path_(
   void);
 
+static
+void
+test_pathfind_(
+  void);
+
+static
+void
+test_pathfind_cb_(
+  upd_pathfind_t* pf);
+
+static
+void
+test_pathfind_many_cb_(
+  upd_pathfind_many_t* pfm);
+
+static
+void
+test_proto_(
+  void);
+
+static
+void
+test_proto_cb_(
+  upd_proto_parse_t* par);
+
+static
+void
+test_proto_defer_cb_(
+  upd_proto_parse_t* par);
+
+static
+void
+test_proto_frames_cb_(
+  upd_proto_parse_t* par);
+
+static
+void*
+test_proto_objpath_resolve_(
+  upd_proto_objpath_t*        op,
+  const msgpack_object_array* path);
+
+static
+void
+test_proto_batch_cb_(
+  upd_proto_batch_t* b);
+
+static
+void
+test_proto_pipeline_cb_(
+  upd_proto_pipeline_t* pl);
+
 static
 void
 test_str_(
@@ -66,11 +283,16 @@ int main(void) {
   assert((UPD_VER >> 16 & 0xFFFF) == UPD_VER_MAJOR);
   assert((UPD_VER >>  0 & 0xFFFF) == UPD_VER_MINOR);
 
+  upd.host = &test_host_;
+
   test_memory_();
 
   test_array_();
   test_buf_();
+  test_msgpack_();
   test_path_();
+  test_pathfind_();
+  test_proto_();
   test_str_();
   test_tensor_();
   test_yaml_();
@@ -78,6 +300,174 @@ int main(void) {
 }
 
 
+static void* test_host_stack_(upd_iso_t* iso, uint64_t len) {
+  (void) iso;
+  return malloc(len);
+}
+
+static void test_host_unstack_(upd_iso_t* iso, void* ptr) {
+  (void) iso;
+  free(ptr);
+}
+
+static uint64_t test_host_now_(upd_iso_t* iso) {
+  (void) iso;
+  return 0;
+}
+
+static upd_file_t* test_host_file_get_(upd_iso_t* iso, upd_file_id_t id) {
+  (void) iso;
+  for (size_t i = 0; i < test_host_files_.n; ++i) {
+    upd_file_t* f = test_host_files_.p[i];
+    if (f->id == id) {
+      return f;
+    }
+  }
+  return NULL;
+}
+
+static void test_host_file_ref_(upd_file_t* f) {
+  ++f->refcnt;
+}
+
+static bool test_host_file_unref_(upd_file_t* f) {
+  assert(f->refcnt);
+  return --f->refcnt;
+}
+
+static bool test_host_file_watch_(upd_file_watch_t* w) {
+  return upd_array_insert(&test_host_watches_, w, SIZE_MAX);
+}
+
+static void test_host_file_unwatch_(upd_file_watch_t* w) {
+  assert(upd_array_find_and_remove(&test_host_watches_, w));
+}
+
+static void test_host_file_trigger_(upd_file_t* f, upd_file_event_t e) {
+  /* callbacks may unwatch others, so takes a snapshot */
+  upd_file_watch_t* ws[16];
+  size_t n = 0;
+  for (size_t i = 0; i < test_host_watches_.n; ++i) {
+    upd_file_watch_t* w = test_host_watches_.p[i];
+    if (w->file == f) {
+      assert(n < sizeof(ws)/sizeof(ws[0]));
+      ws[n++] = w;
+    }
+  }
+  for (size_t i = 0; i < n; ++i) {
+    size_t j;
+    if (upd_array_find(&test_host_watches_, &j, ws[i])) {
+      ws[i]->event = e;
+      ws[i]->cb(ws[i]);
+    }
+  }
+}
+
+static bool test_host_file_lock_(upd_file_lock_t* k) {
+  if (test_host_lock_defer_) {
+    return upd_array_insert(&test_host_locks_, k, SIZE_MAX);
+  }
+  k->ok = true;
+  k->cb(k);
+  return true;
+}
+
+static void test_host_file_unlock_(upd_file_lock_t* k) {
+  (void) k;
+}
+
+static upd_file_t* test_host_dir_new_(
+    upd_file_t* parent, const uint8_t* name, size_t len) {
+  upd_file_t* f = calloc(1, sizeof(*f)+len);
+  assert(f);
+
+  upd_array_t* children = calloc(1, sizeof(*children));
+  assert(children);
+
+  *f = (upd_file_t) {
+    .iso      = test_iso_,
+    .driver   = &test_host_dir_,
+    .npath    = (uint8_t*) (f+1),
+    .npathlen = len,
+    .id       = test_host_files_.n,
+    .ctx      = children,
+  };
+  if (len) {
+    memcpy(f->npath, name, len);
+  }
+
+  assert(upd_array_insert(&test_host_files_, f, SIZE_MAX));
+  if (parent) {
+    assert(upd_array_insert(parent->ctx, f, SIZE_MAX));
+  }
+  return f;
+}
+
+static void test_host_lock_complete_(size_t i) {
+  assert(i < test_host_locks_.n);
+  upd_file_lock_t* k = upd_array_remove(&test_host_locks_, i);
+  k->ok = true;
+  k->cb(k);
+}
+
+static void test_host_clear_(void) {
+  assert(test_host_watches_.n == 0 && test_host_locks_.n == 0);
+  for (size_t i = 0; i < test_host_files_.n; ++i) {
+    upd_file_t* f = test_host_files_.p[i];
+    upd_array_clear(f->ctx);
+    free(f->ctx);
+    free(f);
+  }
+  upd_array_clear(&test_host_files_);
+}
+
+static bool test_host_dir_handle_(upd_req_t* req) {
+  upd_array_t*         children = req->file->ctx;
+  upd_req_dir_entry_t* e        = &req->dir.entry;
+
+  switch (req->type) {
+  case UPD_REQ_DIR_FIND:
+    e->file = NULL;
+    for (size_t i = 0; i < children->n; ++i) {
+      upd_file_t* f = children->p[i];
+      if (upd_streq(f->npath, f->npathlen, e->name, e->len)) {
+        e->file = f;
+      }
+    }
+    break;
+
+  case UPD_REQ_DIR_NEWDIR:
+    e->file = test_host_dir_new_(req->file, e->name, e->len);
+    upd_file_trigger(req->file, UPD_FILE_UPDATE);
+    break;
+
+  case UPD_REQ_DIR_NEWPATH: {
+    if (!test_host_newpath_accept_) {
+      return false;
+    }
+    assert(e->len <= sizeof(test_host_newpath_));
+    memcpy(test_host_newpath_, e->name, e->len);
+    test_host_newpath_len_ = e->len;
+
+    upd_file_t* f = req->file;
+    upd_path_iter_t itr = { .path = e->name, .len = e->len, };
+    while (upd_path_iter_next(&itr)) {
+      assert(itr.namelen);
+      f = test_host_dir_new_(f, itr.name, itr.namelen);
+    }
+    e->file = f;
+    upd_file_trigger(req->file, UPD_FILE_UPDATE);
+  } break;
+
+  default:
+    return false;
+  }
+  req->result = UPD_REQ_OK;
+  req->cb(req);
+  return true;
+}
+
+
 static void test_array_(void) {
   upd_array_t a = {0};
 
@@ -142,6 +532,831 @@ static void test_memory_(void) {
   upd_free(&ptr);
 }
 
+static void test_msgpack_(void) {
+# define str_(v) { .type = MSGPACK_OBJECT_STR, .via = { .str = { .ptr = v, .size = sizeof(v)-1, }, }, }
+# define int_(v) { .type = MSGPACK_OBJECT_POSITIVE_INTEGER, .via = { .u64 = v, }, }
+
+  msgpack_object_kv kvs[] = {
+    { .key = str_("cat"),   .val = str_("kawaii"), },
+    { .key = str_("vim"),   .val = int_(10000),    },
+    { .key = str_("emacs"), .val = int_(1),        },
+    { .key = str_("vim"),   .val = int_(20000),    },
+  };
+  const msgpack_object_map map = { .size = 4, .ptr = kvs, };
+
+# undef int_
+# undef str_
+
+  static upd_msgpack_fieldset_t fs = {0};
+
+  const msgpack_object_str* cat = NULL;
+  uintmax_t vim = 0;
+  bool      dog = false;
+  const upd_msgpack_field_t fields[] = {
+    { .name = "cat", .required = true,  .str = &cat, },
+    { .name = "vim", .required = true,  .ui  = &vim, },
+    { .name = "dog", .required = false, .b   = &dog, },
+    { NULL, },
+  };
+  assert(!upd_msgpack_find_fields_compiled(&map, &fs, fields));
+  assert(fs.compiled && fs.names.n == 3);
+  assert(cat && upd_streq_c("kawaii", cat->ptr, cat->size));
+  assert(vim == 10000);
+  assert(!dog);
+
+  fs.reject_dup = true;
+  assert(upd_streq_c("vim", upd_msgpack_find_fields_compiled(&map, &fs, fields), 3));
+
+  fs.reject_dup     = false;
+  fs.reject_unknown = true;
+  assert(utf8cmp(upd_msgpack_find_fields_compiled(&map, &fs, fields), UPD_MSGPACK_FIELD_UNKNOWN) == 0);
+
+  fs.reject_unknown = false;
+  assert(upd_streq_c("dog", upd_msgpack_find_fields_compiled(&map, &fs, (upd_msgpack_field_t[]) {
+      { .name = "cat", .str = &cat, },
+      { .name = "vim", .ui  = &vim, },
+      { .name = "dog", .b   = &dog, .required = true, },
+      { NULL, },
+    }), 3));
+
+  /* a large field list is still found */
+  static upd_msgpack_fieldset_t large_fs = {0};
+  upd_msgpack_field_t large[41] = {
+    { .name = "cat", .required = true, .str = &cat, },
+  };
+  for (size_t i = 1; i < 40; ++i) {
+    large[i].name = "none";
+  }
+  cat = NULL;
+  assert(!upd_msgpack_find_fields_compiled(&map, &large_fs, large));
+  assert(large_fs.compiled && large_fs.names.n == 40);
+  assert(cat && upd_streq_c("kawaii", cat->ptr, cat->size));
+
+  /* {"a": [1, -1, "xyz"], "b": true, "c": 1.5} */
+  static const uint8_t msg[] = {
+    0x83,
+      0xa1, 'a', 0x93, 0x01, 0xff, 0xa3, 'x', 'y', 'z',
+      0xa1, 'b', 0xc3,
+      0xa1, 'c', 0xcb, 0x3f, 0xf8, 0, 0, 0, 0, 0, 0,
+  };
+  upd_buf_t trace = {0};
+  upd_msgpack_visitor_t v = {
+    .udata = &trace,
+    .cb    = test_msgpack_visitor_cb_,
+  };
+  for (size_t i = 0; i < sizeof(msg); ++i) {
+    assert(upd_msgpack_visitor_feed(&v, msg+i, 1));
+  }
+  assert(v.depth == 0);
+  assert(upd_streq_c("{Ka,[uixyz,]Kb,bKc,f}", trace.ptr, trace.size));
+  upd_buf_clear(&trace);
+
+  assert(!upd_msgpack_visitor_feed(&v, (uint8_t[]) { 0xc1, }, 1));
+
+  upd_buf_t      packed = {0};
+  msgpack_packer pk;
+  msgpack_packer_init(&pk, &packed, test_msgpack_write_cb_);
+
+  const int32_t i32[] = { 1, -1, 300, -40000, };
+  assert(!upd_msgpack_pack_array(&pk, UPD_MSGPACK_I32, i32, 4));
+  assert(upd_streq_c(
+    "\x94\x01\xff\xcd\x01\x2c\xd2\xff\xff\x63\xc0", packed.ptr, packed.size));
+  upd_buf_clear(&packed);
+
+  const float f32[] = { 1.5f, -2.f, };
+  assert(!upd_msgpack_pack_blob(&pk, UPD_MSGPACK_F32, f32, 2));
+  assert(packed.size == 2+8 && packed.ptr[0] == 0xd7 && packed.ptr[1] == UPD_MSGPACK_F32);
+
+  float  f32_out[2];
+  size_t n = 2;
+  const msgpack_object blob = {
+    .type = MSGPACK_OBJECT_EXT,
+    .via  = { .ext = { .type = UPD_MSGPACK_F32, .size = 8, .ptr = (char*) packed.ptr+2, }, },
+  };
+  assert(upd_msgpack_unpack_array(&blob, UPD_MSGPACK_F32, f32_out, &n));
+  assert(n == 2 && f32_out[0] == 1.5f && f32_out[1] == -2.f);
+
+  n = 1;
+  assert(!upd_msgpack_unpack_array(&blob, UPD_MSGPACK_F32, f32_out, &n));
+  upd_buf_clear(&packed);
+
+  msgpack_object elems[] = {
+    { .type = MSGPACK_OBJECT_POSITIVE_INTEGER, .via = { .u64 = 65535, }, },
+    { .type = MSGPACK_OBJECT_POSITIVE_INTEGER, .via = { .u64 = 65536, }, },
+  };
+  const msgpack_object arr = {
+    .type = MSGPACK_OBJECT_ARRAY,
+    .via  = { .array = { .size = 2, .ptr = elems, }, },
+  };
+  uint16_t u16_out[2];
+  n = 2;
+  assert(!upd_msgpack_unpack_array(&arr, UPD_MSGPACK_U16, u16_out, &n));
+  elems[1].via.u64 = 7;
+  assert(upd_msgpack_unpack_array(&arr, UPD_MSGPACK_U16, u16_out, &n));
+  assert(n == 2 && u16_out[0] == 65535 && u16_out[1] == 7);
+
+  static const char* const      tmpl_keys[] = { "ok", "value", NULL, };
+  static upd_msgpack_template_t tmpl        = { .keys = tmpl_keys, };
+  assert(!upd_msgpack_template_pack_key(&pk, &tmpl, 0));
+  assert(!upd_msgpack_template_pack_key(&pk, &tmpl, 1));
+  assert(upd_streq_c("\x82\xa2ok\xa5value", packed.ptr, packed.size));
+  upd_buf_clear(&packed);
+
+  size_t         keylen;
+  const uint8_t* key = upd_msgpack_template_key(&tmpl, 1, &keylen);
+  assert(key && upd_streq_c("\xa5value", key, keylen));
+
+  static upd_msgpack_template_t nokeys = {0};
+  assert(upd_msgpack_template_pack_key(&pk, &nokeys, 0) == -1);
+
+  upd_msgpack_t mpk;
+  assert(upd_msgpack_init(&mpk));
+  mpk.cb = test_msgpack_cb_;
+
+  const size_t mem = mpk.mem;
+
+  /* only the length reported by the writer is committed */
+  upd_req_t req = {
+    .type   = UPD_REQ_DSTREAM_WRITE,
+    .stream = { .io = { .size = 16, .reserve = true, }, },
+    .udata  = &mpk,
+    .cb     = test_msgpack_reserve_cb_,
+  };
+  assert(upd_msgpack_handle(&mpk, &req));
+  assert(req.result == UPD_REQ_OK && !mpk.reserving);
+  assert(mpk.mem == mem+3);
+
+  msgpack_unpacked upkd;
+  msgpack_unpacked_init(&upkd);
+  assert(upd_msgpack_pop(&mpk, &upkd));
+  assert(upkd.data.type == MSGPACK_OBJECT_ARRAY && upkd.data.via.array.size == 2);
+  assert(!upd_msgpack_pop(&mpk, &upkd));
+  assert(!mpk.broken && mpk.mem == mem);
+  upd_buf_clear(&test_msgpack_log_);
+
+  /* writes over highmem are held until popping goes down to lowmem,
+   * and completed in order then */
+  mpk.highmem = mem+6;
+  mpk.lowmem  = mem;
+
+  static const uint8_t arr3[] = { 0x92, 0x01, 0x02, };
+  upd_req_t writes[4];
+  for (size_t i = 0; i < 4; ++i) {
+    writes[i] = (upd_req_t) {
+      .type   = UPD_REQ_DSTREAM_WRITE,
+      .stream = { .io = { .buf = (uint8_t*) arr3, .size = 3, }, },
+      .udata  = (void*) (uintptr_t) ('a'+i),
+      .cb     = test_msgpack_write_done_cb_,
+    };
+    assert(upd_msgpack_handle(&mpk, &writes[i]));
+  }
+  assert(mpk.paused && mpk.held.n == 2);
+  assert(upd_streq_c("ambm", test_msgpack_log_.ptr, test_msgpack_log_.size));
+
+  assert(upd_msgpack_pop(&mpk, &upkd));
+  assert(mpk.paused);
+  assert(upd_msgpack_pop(&mpk, &upkd));
+  assert(mpk.paused && mpk.held.n == 0);
+  assert(upd_streq_c("ambmcmdm", test_msgpack_log_.ptr, test_msgpack_log_.size));
+
+  assert(upd_msgpack_pop(&mpk, &upkd));
+  assert(upd_msgpack_pop(&mpk, &upkd));
+  assert(!upd_msgpack_pop(&mpk, &upkd));
+  assert(!mpk.paused && mpk.mem == mem);
+  upd_buf_clear(&test_msgpack_log_);
+
+  /* zones cycle through the pool, which keeps no more than its max */
+  mpk.highmem     = 0;
+  mpk.maxinflight = 5;
+
+  upd_msgpack_inflight_t* infs[5];
+  for (size_t i = 0; i < 5; ++i) {
+    assert(upd_msgpack_unpack(&mpk, arr3, 3));
+  }
+  assert(mpk.mem == mem+15);
+  for (size_t i = 0; i < 5; ++i) {
+    infs[i] = upd_msgpack_begin(&mpk);
+    assert(infs[i] && infs[i]->upkd.zone);
+  }
+  assert(mpk.mem == mem && mpk.zones.n == 0);
+  for (size_t i = 0; i < 5; ++i) {
+    upd_msgpack_end(infs[i]);
+  }
+  assert(mpk.zones.n == UPD_MSGPACK_ZONE_POOL_DEFAULT);
+  upd_buf_clear(&test_msgpack_log_);
+
+  msgpack_zone* reused = mpk.zones.zones[mpk.zones.n-1];
+  assert(upd_msgpack_unpack(&mpk, arr3, 3));
+  assert(upd_msgpack_pop(&mpk, &upkd));
+  assert(mpk.upk.z == reused && mpk.zones.n == UPD_MSGPACK_ZONE_POOL_DEFAULT-1);
+  assert(!upd_msgpack_pop(&mpk, &upkd));
+  assert(mpk.zones.n == UPD_MSGPACK_ZONE_POOL_DEFAULT && mpk.mem == mem);
+
+  /* ordered responses go out in order of the requests, whenever they end */
+  mpk.maxinflight = 2;
+  mpk.ordered     = true;
+  for (uint8_t i = 0; i < 3; ++i) {
+    const uint8_t req_id[] = { 0x81, 0xa2, 'i', 'd', i, };
+    assert(upd_msgpack_unpack(&mpk, req_id, sizeof(req_id)));
+  }
+  infs[0] = upd_msgpack_begin(&mpk);
+  infs[1] = upd_msgpack_begin(&mpk);
+  assert(infs[0] && infs[1] && !upd_msgpack_begin(&mpk));
+  assert(infs[1]->id && infs[1]->id->via.u64 == 1);
+
+  msgpack_packer* rpk = upd_msgpack_respond(infs[1], 1);
+  assert(rpk && !upd_msgpack_pack_cstr(rpk, "r") && !upd_msgpack_pack_bool(rpk, true));
+  upd_msgpack_end(infs[1]);
+  assert(mpk.out.size == 0 && mpk.inflight.n == 2);
+
+  rpk = upd_msgpack_respond(infs[0], 1);
+  assert(rpk && !upd_msgpack_pack_cstr(rpk, "r") && !upd_msgpack_pack_bool(rpk, false));
+  upd_msgpack_end(infs[0]);
+  assert(mpk.inflight.n == 0);
+
+  static const char resps[] =
+    "\x82\xa2id\x00\xa1r\xc2"
+    "\x82\xa2id\x01\xa1r\xc3";
+  assert(upd_streq(resps, sizeof(resps)-1, mpk.out.data, mpk.out.size));
+  assert(upd_streq_c("m", test_msgpack_log_.ptr, test_msgpack_log_.size));
+  upd_buf_clear(&test_msgpack_log_);
+
+  /* a partial read leaves the rest, which a zero size read takes at once */
+  upd_req_t rd = {
+    .type   = UPD_REQ_DSTREAM_READ,
+    .stream = { .io = { .size = 5, }, },
+    .udata  = (void*) (uintptr_t) 'r',
+    .cb     = test_msgpack_write_done_cb_,
+  };
+  assert(upd_msgpack_handle(&mpk, &rd));
+  assert(upd_streq(resps, 5, rd.stream.io.buf, rd.stream.io.size));
+  assert(!rd.stream.io.tail);
+
+  rd.stream.io = (upd_req_stream_io_t) {0};
+  assert(upd_msgpack_handle(&mpk, &rd));
+  assert(upd_streq(resps+5, sizeof(resps)-6, rd.stream.io.buf, rd.stream.io.size));
+  assert(rd.stream.io.tail);
+  assert(upd_streq_c("rr", test_msgpack_log_.ptr, test_msgpack_log_.size));
+  upd_buf_clear(&test_msgpack_log_);
+
+  infs[2] = upd_msgpack_begin(&mpk);
+  assert(infs[2] && infs[2]->id->via.u64 == 2);
+  upd_msgpack_end(infs[2]);
+  assert(mpk.mem == mem);
+
+  /* a burst taken one by one synchronously doesn't nest callbacks */
+  mpk.maxinflight = 1;
+  mpk.ordered     = false;
+  mpk.cb          = test_msgpack_sync_cb_;
+
+  static uint8_t burst[3*1000];
+  for (size_t i = 0; i < sizeof(burst); i += 3) {
+    memcpy(burst+i, arr3, 3);
+  }
+  upd_req_t burst_req = {
+    .type   = UPD_REQ_DSTREAM_WRITE,
+    .stream = { .io = { .buf = burst, .size = sizeof(burst), }, },
+    .udata  = (void*) (uintptr_t) 'w',
+    .cb     = test_msgpack_write_done_cb_,
+  };
+  assert(upd_msgpack_handle(&mpk, &burst_req));
+  assert(test_msgpack_sync_n_ == 1000);
+  assert(test_msgpack_sync_maxdepth_ == 1);
+  assert(!mpk.calling && !mpk.pending && mpk.inflight.n == 0);
+  assert(mpk.mem == mem);
+  upd_buf_clear(&test_msgpack_log_);
+
+  upd_msgpack_deinit(&mpk);
+}
+
+static int test_msgpack_write_cb_(void* data, const char* buf, size_t len) {
+  return upd_buf_append(data, (const uint8_t*) buf, len)? 0: -1;
+}
+
+static void test_msgpack_cb_(upd_msgpack_t* mpk) {
+  (void) mpk;
+  assert(upd_buf_append(&test_msgpack_log_, (uint8_t*) "m", 1));
+}
+
+static void test_msgpack_sync_cb_(upd_msgpack_t* mpk) {
+  upd_msgpack_inflight_t* inf = upd_msgpack_begin(mpk);
+  if (inf == NULL) {
+    return;
+  }
+  ++test_msgpack_sync_n_;
+  if (++test_msgpack_sync_depth_ > test_msgpack_sync_maxdepth_) {
+    test_msgpack_sync_maxdepth_ = test_msgpack_sync_depth_;
+  }
+  upd_msgpack_end(inf);
+  --test_msgpack_sync_depth_;
+}
+
+static void test_msgpack_reserve_cb_(upd_req_t* req) {
+  upd_msgpack_t* mpk = req->udata;
+
+  upd_req_t nest = {
+    .type   = UPD_REQ_DSTREAM_WRITE,
+    .stream = { .io = { .size = 1, .reserve = true, }, },
+  };
+  assert(!upd_msgpack_handle(mpk, &nest));
+  assert(nest.result == UPD_REQ_INVALID);
+
+  memcpy(req->stream.io.buf, "\x92\x01\x02", 3);
+  req->stream.io.size = 3;
+}
+
+static void test_msgpack_write_done_cb_(upd_req_t* req) {
+  const uint8_t c = (uintptr_t) req->udata;
+  assert(req->result == UPD_REQ_OK);
+  assert(upd_buf_append(&test_msgpack_log_, &c, 1));
+}
+
+static bool test_msgpack_visitor_cb_(
+    upd_msgpack_visitor_t* v, const upd_msgpack_event_t* e) {
+  upd_buf_t* buf = v->udata;
+  if (e->key) {
+    assert(upd_buf_append_str(buf, (uint8_t*) "K"));
+  }
+  switch (e->type) {
+  case UPD_MSGPACK_EVENT_MAP:       assert(upd_buf_append_str(buf, (uint8_t*) "{")); break;
+  case UPD_MSGPACK_EVENT_MAP_END:   assert(upd_buf_append_str(buf, (uint8_t*) "}")); break;
+  case UPD_MSGPACK_EVENT_ARRAY:     assert(upd_buf_append_str(buf, (uint8_t*) "[")); break;
+  case UPD_MSGPACK_EVENT_ARRAY_END: assert(upd_buf_append_str(buf, (uint8_t*) "]")); break;
+  case UPD_MSGPACK_EVENT_UINT:      assert(e->u ==  1);  assert(upd_buf_append_str(buf, (uint8_t*) "u")); break;
+  case UPD_MSGPACK_EVENT_INT:       assert(e->i == -1);  assert(upd_buf_append_str(buf, (uint8_t*) "i")); break;
+  case UPD_MSGPACK_EVENT_FLOAT:     assert(e->f == 1.5); assert(upd_buf_append_str(buf, (uint8_t*) "f")); break;
+  case UPD_MSGPACK_EVENT_BOOL:      assert(e->b);        assert(upd_buf_append_str(buf, (uint8_t*) "b")); break;
+  case UPD_MSGPACK_EVENT_STR:
+    assert(upd_buf_append(buf, e->chunk.ptr, e->chunk.size));
+    if (e->chunk.tail) {
+      assert(upd_buf_append_str(buf, (uint8_t*) ","));
+    }
+    break;
+  default:
+    assert(false);
+  }
+  return true;
+}
+
+static void test_pathfind_(void) {
+  upd_file_t* root = test_host_dir_new_(NULL, NULL, 0);
+  upd_file_t* a    = test_host_dir_new_(root, (uint8_t*) "a", 1);
+  upd_file_t* b    = test_host_dir_new_(a,    (uint8_t*) "b", 1);
+
+  upd_pathfind_cache_t c = { .max = 4, };
+  assert(upd_pathfind_cache_init(&c));
+
+  upd_pathfind_t pf = {
+    .iso   = test_iso_,
+    .path  = (uint8_t*) "a/b",
+    .len   = 3,
+    .cache = &c,
+    .cb    = test_pathfind_cb_,
+  };
+  upd_pathfind(&pf);
+  assert(pf.base == b && !pf.len);
+  assert(c.n == 1 && c.misses == 1);
+  assert(test_host_watches_.n == 2 && root->refcnt == 1 && a->refcnt == 1);
+
+  pf = (upd_pathfind_t) {
+    .iso   = test_iso_,
+    .path  = (uint8_t*) "a//b/",
+    .len   = 5,
+    .cache = &c,
+    .cb    = test_pathfind_cb_,
+  };
+  upd_pathfind(&pf);
+  assert(pf.base == b && c.hits == 1);
+
+  pf = (upd_pathfind_t) {
+    .iso   = test_iso_,
+    .path  = (uint8_t*) "b",
+    .len   = 1,
+    .base  = a,
+    .cache = &c,
+    .cb    = test_pathfind_cb_,
+  };
+  upd_pathfind(&pf);
+  assert(pf.base == b);
+
+  /* a failed walk releases the dirs it watched right away */
+  pf = (upd_pathfind_t) {
+    .iso   = test_iso_,
+    .path  = (uint8_t*) "x/y",
+    .len   = 3,
+    .base  = b,
+    .cache = &c,
+    .cb    = test_pathfind_cb_,
+  };
+  upd_pathfind(&pf);
+  assert(pf.len);
+  assert(c.n == 2 && test_host_watches_.n == 2 && b->refcnt == 2);
+
+  /* evicting from a's watch releases root at once, but leaves a idle */
+  upd_file_trigger(a, UPD_FILE_UPDATE);
+  assert(c.n == 0 && c.idle == 1);
+  assert(test_host_watches_.n == 1 && root->refcnt == 0 && b->refcnt == 0);
+
+  pf = (upd_pathfind_t) {
+    .iso   = test_iso_,
+    .path  = (uint8_t*) "a",
+    .len   = 1,
+    .cache = &c,
+    .cb    = test_pathfind_cb_,
+  };
+  upd_pathfind(&pf);
+  assert(pf.base == a && c.idle == 0);
+  assert(test_host_watches_.n == 1 && root->refcnt == 1 && a->refcnt == 1);
+
+  upd_pathfind_cache_deinit(&c);
+  assert(test_host_watches_.n == 0 && root->refcnt == 0 && a->refcnt == 0);
+
+  /* NEWPATH gets the missing part without empty components */
+  test_host_newpath_accept_ = true;
+  pf = (upd_pathfind_t) {
+    .iso     = test_iso_,
+    .path    = (uint8_t*) "a/x//y/",
+    .len     = 7,
+    .create  = true,
+    .newpath = true,
+    .cb      = test_pathfind_cb_,
+  };
+  upd_pathfind(&pf);
+  assert(!pf.len && pf.base && !pf.npath);
+  assert(upd_streq_c("x/y", test_host_newpath_, test_host_newpath_len_));
+  assert(upd_streq_c("y", pf.base->npath, pf.base->npathlen));
+
+  /* or it falls back to NEWDIR one by one, when the driver rejects NEWPATH */
+  test_host_newpath_accept_ = false;
+  pf = (upd_pathfind_t) {
+    .iso     = test_iso_,
+    .path    = (uint8_t*) "p//q",
+    .len     = 4,
+    .create  = true,
+    .newpath = true,
+    .cb      = test_pathfind_cb_,
+  };
+  upd_pathfind(&pf);
+  assert(!pf.len && pf.base && !pf.npath);
+  assert(upd_streq_c("q", pf.base->npath, pf.base->npathlen));
+
+  upd_pathfind_many_item_t items[] = {
+    { .path = (uint8_t*) "a/b", .len = 3, },
+    { .path = (uint8_t*) "/a",  .len = 2, },
+    { .path = (uint8_t*) "a/z", .len = 3, },
+  };
+  upd_pathfind_many_t pfm = {
+    .iso   = test_iso_,
+    .items = items,
+    .n     = sizeof(items)/sizeof(items[0]),
+    .cb    = test_pathfind_many_cb_,
+  };
+  assert(upd_pathfind_many(&pfm));
+  assert(pfm.base == root);
+  assert(items[0].file == b && items[1].file == a && items[2].file == NULL);
+
+  test_host_clear_();
+}
+
+static void test_pathfind_cb_(upd_pathfind_t* pf) {
+  (void) pf;
+}
+
+static void test_pathfind_many_cb_(upd_pathfind_many_t* pfm) {
+  (void) pfm;
+}
+
+static void test_proto_(void) {
+# define str_(v) { .type = MSGPACK_OBJECT_STR, .via = { .str = { .ptr = v, .size = sizeof(v)-1, }, }, }
+
+  msgpack_object_kv kvs[] = {
+    { .key = str_("interface"), .val = str_("OBJECT"), },
+    { .key = str_("command"),   .val = str_("unlock"), },
+  };
+  const msgpack_object root = {
+    .type = MSGPACK_OBJECT_MAP,
+    .via  = { .map = { .size = 2, .ptr = kvs, }, },
+  };
+
+  upd_proto_parse_t par = {
+    .src   = &root,
+    .iface = UPD_PROTO_OBJECT,
+    .cb    = test_proto_cb_,
+  };
+  upd_proto_parse(&par);
+  assert(!par.err);
+  assert(par.msg.iface == UPD_PROTO_OBJECT && par.msg.cmd == UPD_PROTO_OBJECT_UNLOCK);
+
+  kvs[1].val = (msgpack_object) str_("Unlock");
+  par = (upd_proto_parse_t) { .src = &root, .iface = UPD_PROTO_OBJECT, .cb = test_proto_cb_, };
+  upd_proto_parse(&par);
+  assert(utf8cmp(par.err, "unknown command") == 0);
+
+  static const upd_proto_cmd_def_t cmds[] = {
+    { .name = "unlock", .cmd = 1, },
+    { NULL, },
+  };
+  static const upd_proto_iface_def_t iface = {
+    .name  = "extra",
+    .iface = 0x0100,
+    .cmds  = cmds,
+  };
+  static upd_proto_dispatch_t d;
+  upd_proto_dispatch_init(&d);
+  assert(upd_proto_dispatch_add(&d, &iface));
+  assert(!upd_proto_dispatch_add(&d, &iface));
+
+  /* the same name in another case rejects the whole interface */
+  static const upd_proto_cmd_def_t dup_cmds[] = {
+    { .name = "lock",   .cmd = 2, },
+    { .name = "unlock", .cmd = 1, },
+    { NULL, },
+  };
+  static const upd_proto_iface_def_t dup = {
+    .name  = "EXTRA",
+    .iface = 0x0100,
+    .cmds  = dup_cmds,
+  };
+  const size_t dn = d.ifaces.n;
+  assert(!upd_proto_dispatch_add(&d, &dup));
+  assert(d.ifaces.n == dn);
+
+  /* so does a command duplicated in the definition */
+  static const upd_proto_cmd_def_t twice_cmds[] = {
+    { .name = "lock", .cmd = 1, },
+    { .name = "lock", .cmd = 2, },
+    { NULL, },
+  };
+  static const upd_proto_iface_def_t twice = {
+    .name  = "twice",
+    .iface = 0x0200,
+    .cmds  = twice_cmds,
+  };
+  assert(!upd_proto_dispatch_add(&d, &twice));
+  assert(d.ifaces.n == dn);
+
+  kvs[0].val = (msgpack_object) str_("Extra");
+  kvs[1].val = (msgpack_object) str_("unlock");
+  par = (upd_proto_parse_t) { .src = &root, .iface = UPD_PROTO_OBJECT, .cb = test_proto_cb_, };
+  upd_proto_parse(&par);
+  assert(utf8cmp(par.err, "unknown interface") == 0);
+
+  par = (upd_proto_parse_t) {
+    .src      = &root,
+    .iface    = UPD_PROTO_OBJECT | 0x0100,
+    .dispatch = &d,
+    .cb       = test_proto_cb_,
+  };
+  upd_proto_parse(&par);
+  assert(!par.err);
+  assert(par.msg.iface == 0x0100 && par.msg.cmd == 1);
+
+  upd_proto_parse_pool_t pool = { .max = 1, };
+  for (size_t i = 0; i < 2; ++i) {
+    assert(upd_proto_parse_with_pool(&pool, &par));
+  }
+  assert(pool.inuse == 0 && pool.highwater == 1 && pool.allocs == 1 && pool.n == 1);
+
+  /* a deferred copy goes back to the pool by release */
+  upd_proto_parse_t* deferred = NULL;
+  par.defer = true;
+  par.udata = &deferred;
+  par.cb    = test_proto_defer_cb_;
+  assert(upd_proto_parse_with_pool(&pool, &par));
+  assert(deferred && pool.inuse == 1 && pool.n == 0);
+  upd_proto_parse_release(deferred);
+  assert(pool.inuse == 0 && pool.n == 1);
+  upd_proto_parse_pool_clear(&pool);
+  upd_proto_dispatch_deinit(&d);
+
+  kvs[0].val = (msgpack_object) str_("encoder");
+  kvs[1].val = (msgpack_object) str_("info");
+
+  size_t done = 0;
+  upd_proto_pipeline_t pl = {
+    .depth = 2,
+    .udata = &done,
+    .cb    = test_proto_pipeline_cb_,
+  };
+  assert(upd_proto_pipeline_init(&pl));
+  for (size_t i = 0; i < 4; ++i) {
+    assert(upd_proto_pipeline_submit(&pl, &root, (void*) (i+1)));
+  }
+  assert(done == 4);
+  upd_proto_pipeline_deinit(&pl);
+
+  msgpack_object segs[] = {
+    str_("layers"),
+    { .type = MSGPACK_OBJECT_POSITIVE_INTEGER, .via = { .u64 = 2, }, },
+  };
+  const msgpack_object_array path = { .size = 2, .ptr = segs, };
+
+  size_t resolved = 0;
+  upd_proto_objpath_t op = {
+    .max     = 4,
+    .udata   = &resolved,
+    .resolve = test_proto_objpath_resolve_,
+  };
+  assert(upd_proto_objpath_init(&op));
+  assert(upd_proto_objpath_find(&op, &path) == &resolved);
+  assert(upd_proto_objpath_find(&op, &path) == &resolved);
+  assert(resolved == 1 && op.hits == 1);
+
+  upd_proto_objpath_invalidate(&op);
+  assert(upd_proto_objpath_find(&op, &path) == &resolved);
+  assert(resolved == 2);
+  upd_proto_objpath_deinit(&op);
+
+  msgpack_object_kv lock[] = {
+    { .key = str_("interface"), .val = str_("object"), },
+    { .key = str_("command"),   .val = str_("lock"),   },
+  };
+  msgpack_object msgs[] = {
+    { .type = MSGPACK_OBJECT_MAP, .via = { .map = { .size = 2, .ptr = lock, }, }, },
+    root,
+  };
+  msgpack_object_kv env[] = {
+    { .key = str_("batch"),  .val = { .type = MSGPACK_OBJECT_ARRAY,   .via = { .array = { .size = 2, .ptr = msgs, }, }, }, },
+    { .key = str_("strict"), .val = { .type = MSGPACK_OBJECT_BOOLEAN, .via = { .boolean = false, }, }, },
+  };
+  const msgpack_object batch = {
+    .type = MSGPACK_OBJECT_MAP,
+    .via  = { .map = { .size = 2, .ptr = env, }, },
+  };
+
+  upd_proto_batch_t b = {
+    .src   = &batch,
+    .iface = UPD_PROTO_ENCODER | UPD_PROTO_OBJECT,
+    .cb    = test_proto_batch_cb_,
+  };
+  upd_proto_batch_parse(&b);
+  assert(!b.err);
+
+  env[1].val.via.boolean = true;
+  upd_proto_batch_parse(&b);
+  assert(utf8cmp(b.err, "strict batch has invalid command") == 0);
+
+  msgpack_object reso[] = {
+    { .type = MSGPACK_OBJECT_POSITIVE_INTEGER, .via = { .u64 = 2, }, },
+    { .type = MSGPACK_OBJECT_POSITIVE_INTEGER, .via = { .u64 = 3, }, },
+  };
+  msgpack_object_kv tensor[] = {
+    { .key = str_("type"), .val = str_("u16"), },
+    { .key = str_("reso"), .val = { .type = MSGPACK_OBJECT_ARRAY, .via = { .array = { .size = 2, .ptr = reso, }, }, }, },
+    { .key = str_("data"), .val = { .type = MSGPACK_OBJECT_BIN,   .via = { .bin   = { .size = 12, .ptr = "0123456789ab", }, }, }, },
+  };
+  msgpack_object_kv param[] = {
+    { .key = str_("tensor"), .val = { .type = MSGPACK_OBJECT_MAP, .via = { .map = { .size = 3, .ptr = tensor, }, }, }, },
+  };
+  msgpack_object_kv frame[] = {
+    { .key = str_("interface"), .val = str_("encoder"), },
+    { .key = str_("command"),   .val = str_("frame"),   },
+    { .key = str_("param"),     .val = { .type = MSGPACK_OBJECT_MAP, .via = { .map = { .size = 1, .ptr = param, }, }, }, },
+  };
+  const msgpack_object frame_root = {
+    .type = MSGPACK_OBJECT_MAP,
+    .via  = { .map = { .size = 3, .ptr = frame, }, },
+  };
+  par = (upd_proto_parse_t) { .src = &frame_root, .iface = UPD_PROTO_ENCODER, .defer = true, .cb = test_proto_cb_, };
+  upd_proto_parse(&par);
+  assert(!par.err);
+  assert(par.msg.encoder_frame.file == NULL);
+  assert(par.msg.encoder_frame.tensor.meta.rank == 2);
+  assert(par.msg.encoder_frame.tensor.meta.reso[1] == 3);
+  assert(par.msg.encoder_frame.tensor.size == 12);
+  upd_proto_parse_release(&par);
+
+  tensor[2].val.via.bin.size = 11;
+  par = (upd_proto_parse_t) { .src = &frame_root, .iface = UPD_PROTO_ENCODER, .cb = test_proto_cb_, };
+  upd_proto_parse(&par);
+  assert(utf8cmp(par.err, "invalid tensor") == 0);
+
+  upd_file_t* fr = test_host_dir_new_(NULL, NULL, 0);
+  upd_file_t* fa = test_host_dir_new_(fr, (uint8_t*) "a", 1);
+  upd_file_t* fb = test_host_dir_new_(fa, (uint8_t*) "b", 1);
+
+  upd_file_t* want[] = { fb, fr, fa, };
+
+  /* paths and ids are mixed, and files come in order of the array */
+  msgpack_object files[] = {
+    str_("a/b"),
+    { .type = MSGPACK_OBJECT_POSITIVE_INTEGER, .via = { .u64 = fr->id, }, },
+    str_("/a"),
+  };
+  msgpack_object_kv frames_param[] = {
+    { .key = str_("files"), .val = { .type = MSGPACK_OBJECT_ARRAY, .via = { .array = { .size = 3, .ptr = files, }, }, }, },
+  };
+  frame[1].val = (msgpack_object) str_("frames");
+  frame[2].val = (msgpack_object) {
+    .type = MSGPACK_OBJECT_MAP,
+    .via  = { .map = { .size = 1, .ptr = frames_param, }, },
+  };
+  par = (upd_proto_parse_t) {
+    .iso   = test_iso_,
+    .src   = &frame_root,
+    .iface = UPD_PROTO_ENCODER,
+    .udata = want,
+    .cb    = test_proto_frames_cb_,
+  };
+  upd_proto_parse(&par);
+  assert(!par.err);
+  assert(fr->refcnt == 0 && fa->refcnt == 0 && fb->refcnt == 0);
+
+  files[2] = (msgpack_object) str_("a/x");
+  par = (upd_proto_parse_t) { .iso = test_iso_, .src = &frame_root, .iface = UPD_PROTO_ENCODER, .cb = test_proto_cb_, };
+  upd_proto_parse(&par);
+  assert(utf8cmp(par.err, "file not found") == 0);
+
+  files[2] = (msgpack_object) { .type = MSGPACK_OBJECT_POSITIVE_INTEGER, .via = { .u64 = 100, }, };
+  par = (upd_proto_parse_t) { .iso = test_iso_, .src = &frame_root, .iface = UPD_PROTO_ENCODER, .cb = test_proto_cb_, };
+  upd_proto_parse(&par);
+  assert(utf8cmp(par.err, "file not found") == 0);
+  assert(fr->refcnt == 0 && fa->refcnt == 0 && fb->refcnt == 0);
+
+  /* frames finishing out of order still come out in order of submission,
+   * while slots wrap around the ring */
+  param[0] = (msgpack_object_kv) { .key = str_("file"), .val = str_("a"), };
+  frame[1].val = (msgpack_object) str_("frame");
+  frame[2].val = (msgpack_object) {
+    .type = MSGPACK_OBJECT_MAP,
+    .via  = { .map = { .size = 1, .ptr = param, }, },
+  };
+
+  done = 0;
+  pl = (upd_proto_pipeline_t) {
+    .iso   = test_iso_,
+    .depth = 3,
+    .udata = &done,
+    .cb    = test_proto_pipeline_cb_,
+  };
+  assert(upd_proto_pipeline_init(&pl));
+  assert(upd_proto_pipeline_submit(&pl, &root, (void*) 1));
+  assert(done == 1 && pl.head == 1);
+
+  test_host_lock_defer_ = true;
+  for (uintptr_t i = 2; i <= 4; ++i) {
+    assert(upd_proto_pipeline_submit(&pl, &frame_root, (void*) i));
+  }
+  assert(!upd_proto_pipeline_submit(&pl, &root, (void*) 5));
+  assert(test_host_locks_.n == 3 && fa->refcnt == 0);
+
+  test_host_lock_complete_(2);  /* item 4 */
+  assert(done == 1 && fa->refcnt == 1);
+  test_host_lock_complete_(0);  /* item 2 */
+  assert(done == 2 && fa->refcnt == 1);
+
+  assert(upd_proto_pipeline_submit(&pl, &root, (void*) 5));
+  assert(done == 2);
+  test_host_lock_complete_(0);  /* item 3 */
+  assert(done == 5 && pl.n == 0 && fa->refcnt == 0);
+
+  test_host_lock_defer_ = false;
+  upd_proto_pipeline_deinit(&pl);
+
+  test_host_clear_();
+
+# undef str_
+}
+
+static void test_proto_cb_(upd_proto_parse_t* par) {
+  assert(par->refcnt == 0);
+}
+
+static void test_proto_defer_cb_(upd_proto_parse_t* par) {
+  *(upd_proto_parse_t**) par->udata = par;
+}
+
+static void test_proto_frames_cb_(upd_proto_parse_t* par) {
+  upd_file_t** want = par->udata;
+  assert(!par->err);
+  assert(par->msg.cmd == UPD_PROTO_ENCODER_FRAMES && par->msg.encoder_frames.n == 3);
+  for (size_t i = 0; i < 3; ++i) {
+    assert(par->msg.encoder_frames.files[i] == want[i]);
+    assert(want[i]->refcnt == 1);
+  }
+}
+
+static void* test_proto_objpath_resolve_(
+    upd_proto_objpath_t* op, const msgpack_object_array* path) {
+  (void) path;
+  size_t* resolved = op->udata;
+  ++*resolved;
+  return resolved;
+}
+
+static void test_proto_batch_cb_(upd_proto_batch_t* b) {
+  assert(b->n == 2);
+  assert(b->pars[0].msg.cmd == UPD_PROTO_OBJECT_LOCK);
+  assert(b->strict || b->pars[1].msg.cmd == UPD_PROTO_ENCODER_INFO);
+}
+
+static void test_proto_pipeline_cb_(upd_proto_pipeline_t* pl) {
+  size_t* done = pl->udata;
+  assert(!pl->err);
+  assert(pl->msg->cmd == UPD_PROTO_ENCODER_INFO || pl->msg->encoder_frame.file);
+  assert((uintptr_t) pl->item == ++*done);
+}
+
 static void test_path_(void) {
   uint8_t      p1[] = "///hell//world//////";
   const size_t l1   = upd_path_normalize(p1, sizeof(p1)-1);
@@ -181,6 +1396,19 @@ static void test_path_(void) {
   const size_t l7   = upd_path_normalize(p7, sizeof(p7)-2);
   assert(upd_streq_c("../../../", p7, l7));
   assert(p7[sizeof(p7)-2] == 'A');  /* canary check */
+
+  const uint8_t   p8[] = "//foo///bar/baz//";
+  upd_path_iter_t itr  = { .path = p8, .len = sizeof(p8)-1, };
+  assert(upd_path_iter_next(&itr));
+  assert(upd_streq_c("foo", itr.name, itr.namelen));
+  assert(itr.hash == upd_path_hash((uint8_t*) "foo", 3));
+  assert(upd_path_iter_next(&itr));
+  assert(upd_streq_c("bar", itr.name, itr.namelen));
+  assert(upd_path_iter_next(&itr));
+  assert(upd_streq_c("baz", itr.name, itr.namelen));
+  assert(itr.hash != upd_path_hash((uint8_t*) "bar", 3));
+  assert(!upd_path_iter_next(&itr));
+  assert(!upd_path_iter_next(&itr));
 }
 
 static void test_str_(void) {
@@ -243,6 +1471,78 @@ static void test_str_(void) {
 
   assert(upd_strcase_switch((uint8_t*) "C", 1, cases) == &cases[2]);
   assert(upd_strcase_switch((uint8_t*) "c", 1, cases) == &cases[2]);
+
+  /* the table grows as names are added */
+  upd_str_set_t set = {0};
+  assert(upd_str_set_find(&set, "a", 1) == SIZE_MAX);
+  static const char* const names[] = {
+    "a", "b", "c", "d", "e", "f", "g", "h", "i", "j", "k", "l", "m", "n", "o", "p",
+    "q", "r", "s", "t", "u", "v", "w", "x", "y", "z", "0", "1", "2", "3", "4", "5",
+    "6", "7", "8", "9", "A", "B", "C", "D",
+  };
+  const size_t namen = sizeof(names)/sizeof(names[0]);
+  for (size_t i = 0; i < namen; ++i) {
+    assert(upd_str_set_add(&set, names[i]));
+  }
+  assert(set.n == namen && set.cap >= namen*2);
+  for (size_t i = 0; i < namen; ++i) {
+    assert(upd_str_set_find(&set, names[i], 1) == i);
+  }
+  assert(upd_str_set_find(&set, "E", 1) == SIZE_MAX);
+  assert(upd_str_set_find(&set, "ab", 2) == SIZE_MAX);
+
+  upd_str_set_reset(&set);
+  assert(set.n == 0 && set.cap && upd_str_set_find(&set, "a", 1) == SIZE_MAX);
+  upd_str_set_clear(&set);
+  assert(set.keys == NULL && set.cap == 0);
+
+  set.caseless = true;
+  assert(upd_str_set_add(&set, "Encoder"));
+  assert(upd_str_set_find(&set, "eNCODER", 7) == 0);
+  assert(upd_str_set_find(&set, "encode", 6) == SIZE_MAX);
+  upd_str_set_clear(&set);
+  assert(set.caseless);
+
+# define parse_(T, s, v) upd_str_parse_##T((uint8_t*) s, sizeof(s)-1, v)
+  uintmax_t ui;
+  assert( parse_(uint, "18446744073709551615", &ui) && ui == UINTMAX_MAX);
+  assert(!parse_(uint, "18446744073709551616", &ui));
+  assert( parse_(uint, "0x1F", &ui) && ui == 31);
+  assert( parse_(uint, "017",  &ui) && ui == 15);
+  assert(!parse_(uint, "018",  &ui));
+  assert(!parse_(uint, "0x",   &ui));
+  assert(!parse_(uint, "-1",   &ui));
+
+  intmax_t i;
+  assert( parse_(int, "-9223372036854775808", &i) && i == INTMAX_MIN);
+  assert(!parse_(int, "9223372036854775808",  &i));
+  assert( parse_(int, "-0x10", &i) && i == -16);
+  assert(!parse_(int, "1.0",   &i));
+
+  double f;
+  assert( parse_(double, "-100.32", &f) && f == -100.32);
+  assert( parse_(double, ".5e1",    &f) && f == 5);
+  assert( parse_(double, "0x10",    &f) && f == 16);
+  assert( parse_(double, "-0x1.8p1", &f) && f == -3);
+  assert( parse_(double, "0x.01",   &f) && f == 1./256);
+  assert( parse_(double, "0x1p-1074", &f) && f == 0x1p-1074);
+  assert( parse_(double, "0x1.00000000000008000000001p0", &f) && f == 0x1.0000000000001p0);
+  assert( parse_(double, "0x1.00000000000008p0", &f) && f == 1);
+  assert( parse_(double, "0x123456789abcdef0123p0", &f) && f == 0x123456789abcdef0123p0);
+  assert(!parse_(double, "0x",      &f));
+  assert(!parse_(double, "0x1p",    &f));
+  assert( parse_(double, "-inf",    &f) && isinf(f) && f < 0);
+  assert( parse_(double, "Infinity", &f) && isinf(f) && f > 0);
+  assert( parse_(double, "NaN",     &f) && isnan(f));
+  assert( parse_(double, "nan(0x1_a)", &f) && isnan(f));
+  assert(!parse_(double, "nan(",    &f));
+  assert(!parse_(double, "infinit", &f));
+  assert(!parse_(double, "1e",      &f));
+  assert(!parse_(double, "1.2.3",   &f));
+  assert( parse_(double, "2.2250738585072011e-308", &f) && f == 2.2250738585072011e-308);
+  assert( parse_(double, "1234567890123456789012345678901234567890e-20", &f) &&
+    f == 12345678901234567890.123456789012345678901234567890);
+# undef parse_
 }
 
 static void test_tensor_(void) {
@@ -317,7 +1617,128 @@ static void test_yaml_(void) {
 
   assert(vscode == NULL);
 
+  static upd_yaml_fieldset_t fs = {0};
+  const upd_yaml_field_t fields[] = {
+    { .name = "dog",    .str = &dog, },
+    { .name = "vscode", .required = true, .str = &vscode, },
+    { NULL },
+  };
+  dog = NULL;
+  const yaml_node_t* root = yaml_document_get_root_node(&doc);
+  assert(upd_yaml_find_fields_compiled(&doc, root, &fs, fields) == fields[1].name);
+  assert(fs.compiled && fs.names.n == 2);
+  assert(dog);
+  assert(upd_streq_c("noisy", dog->data.scalar.value, dog->data.scalar.length));
+
+  /* a large field list is compiled as well */
+  static upd_yaml_fieldset_t large_fs = {0};
+  upd_yaml_field_t large[41] = {
+    { .name = "cat", .required = true, .str = &cat, },
+  };
+  for (size_t i = 1; i < 40; ++i) {
+    large[i].name = "none";
+  }
+  cat = NULL;
+  assert(!upd_yaml_find_fields_compiled(&doc, root, &large_fs, large));
+  assert(large_fs.compiled && large_fs.names.n == 40);
+  assert(cat);
+
   yaml_document_delete(&doc);
 
   assert(!upd_yaml_parse(&doc, case2, sizeof(case2)-1));
+
+  const uint8_t case3[] =
+    "cat: kawaii\n"
+    "ignored: [1, {a: b}]\n"
+    "editor:\n"
+    "  vim  : 10000\n"
+    "  emacs: -100.32\n"
+    "cat: noisy\n";
+
+  upd_buf_t   cat_buf = {0};
+  bool        editor_ok;
+  const char* invalid;
+
+  const upd_yaml_field_t editor_fields[] = {
+    { .name = "vim",   .required = true, .ui = &vim_ui, },
+    { .name = "emacs", .required = true, .f  = &emacs_f, },
+    { NULL },
+  };
+  assert(upd_yaml_stream_fields(case3, sizeof(case3)-1, (upd_yaml_field_t[]) {
+      { .name = "cat",    .required = true, .buf = &cat_buf, },
+      { .name = "editor", .required = true, .fields = editor_fields, },
+      { NULL },
+    }, &invalid));
+  assert(upd_streq_c("kawaii", cat_buf.ptr, cat_buf.size));
+  assert(vim_ui  == 10000);
+  assert(emacs_f == -100.32);
+  upd_buf_clear(&cat_buf);
+
+  assert(!upd_yaml_stream_fields(case3, sizeof(case3)-1, (upd_yaml_field_t[]) {
+      { .name = "editor", .b = &editor_ok, },
+      { NULL },
+    }, &invalid));
+  assert(upd_streq_c("editor", invalid, utf8size_lazy(invalid)));
+
+  assert(!upd_yaml_stream_fields(case2, sizeof(case2)-1, (upd_yaml_field_t[]) {
+      { NULL },
+    }, &invalid));
+  assert(invalid == NULL);
+
+  /* both loaders name the innermost missing field */
+  const upd_yaml_field_t editor_nano[] = {
+    { .name = "nano", .required = true, .ui = &vim_ui, },
+    { NULL },
+  };
+  const upd_yaml_field_t editor_root[] = {
+    { .name = "editor", .required = true, .fields = editor_nano, },
+    { NULL },
+  };
+  assert(!upd_yaml_stream_fields(case3, sizeof(case3)-1, editor_root, &invalid));
+  assert(invalid == editor_nano[0].name);
+
+  assert(upd_yaml_parse(&doc, case3, sizeof(case3)-1));
+  assert(upd_yaml_find_fields_from_root(&doc, editor_root) == editor_nano[0].name);
+  yaml_document_delete(&doc);
+
+  /* both loaders take a field list longer than UPD_YAML_FIELDSET_MAX */
+  static const char* const many_names[] = {
+    "f00", "f01", "f02", "f03", "f04", "f05", "f06", "f07", "f08", "f09",
+    "f10", "f11", "f12", "f13", "f14", "f15", "f16", "f17", "f18", "f19",
+    "f20", "f21", "f22", "f23", "f24", "f25", "f26", "f27", "f28", "f29",
+    "f30", "f31", "f32", "f33", "f34", "f35", "f36", "f37", "f38", "f39",
+    "cat", "editor",
+  };
+  const size_t many_n = sizeof(many_names)/sizeof(many_names[0]);
+
+  upd_yaml_field_t many[sizeof(many_names)/sizeof(many_names[0])+1] = {0};
+  for (size_t i = 0; i < many_n; ++i) {
+    many[i].name = many_names[i];
+  }
+  many[many_n-2].required = true;
+  many[many_n-2].buf      = &cat_buf;
+  many[many_n-1].required = true;
+  many[many_n-1].fields   = editor_fields;
+
+  vim_ui = 0;
+  assert(upd_yaml_stream_fields(case3, sizeof(case3)-1, many, &invalid));
+  assert(upd_streq_c("kawaii", cat_buf.ptr, cat_buf.size));
+  assert(vim_ui == 10000);
+  upd_buf_clear(&cat_buf);
+
+  vim_ui = 0;
+  assert(upd_yaml_parse(&doc, case3, sizeof(case3)-1));
+  assert(!upd_yaml_find_fields_from_root(&doc, many));
+  assert(upd_streq_c("kawaii", cat_buf.ptr, cat_buf.size));
+  assert(vim_ui == 10000);
+  upd_buf_clear(&cat_buf);
+
+  many[0].required = true;
+  assert(upd_yaml_find_fields_from_root(&doc, many) == many_names[0]);
+  yaml_document_delete(&doc);
+  upd_buf_clear(&cat_buf);
+
+  assert(!upd_yaml_stream_fields(case3, sizeof(case3)-1, many, &invalid));
+  assert(invalid == many_names[0]);
+  upd_buf_clear(&cat_buf);
 }